@@ -2,7 +2,7 @@
  * Foldr Programming Language - Interpreter
  * Version 1.0.1
  * Compile: gcc -o foldr foldr.c -lm
- * Usage: ./foldr [file.fld]
+ * Usage: ./foldr [--engine=tree|vm] [file.fld]
  *        ./foldr (shows ASCII logo)
  */
 
@@ -11,12 +11,25 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <time.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 #define VERSION "1.0.1"
-#define MAX_TOKEN_LEN 256
-#define MAX_TOKENS 10000
-#define MAX_VARS 1000
-#define MAX_FUNCS 100
+#define TOKEN_LOOKAHEAD 8
 #define MAX_STACK 1000
 
 // ============= TOKEN TYPES =============
@@ -41,19 +54,40 @@ typedef enum {
     // Punctuation
     TOK_LPAREN, TOK_RPAREN, TOK_LBRACE, TOK_RBRACE,
     TOK_LBRACK, TOK_RBRACK, TOK_SEMICOLON, TOK_COLON,
-    TOK_COMMA, TOK_ARROW, TOK_DOT
+    TOK_COMMA, TOK_ARROW, TOK_DOT, TOK_AT
 } TokenType;
 
+// Every distinct identifier is interned once, so names compare by pointer.
+typedef struct Symbol {
+    const char *name;
+    int length;
+    unsigned hash;
+    TokenType keyword;      // TOK_IDENTIFIER unless the name is reserved
+    struct Builtin *builtin; // native function of the same name, if any
+    int serial;             // 1 + index in the .fldc being written, 0 if not in it
+    struct Symbol *next;    // hash chain
+} Symbol;
+
+// Tokens are spans into the source text; nothing is copied. String
+// literal spans exclude the quotes.
 typedef struct {
     TokenType type;
-    char value[MAX_TOKEN_LEN];
     int line;
+    const char *start;
+    int length;
+    Symbol *sym;            // identifiers and keywords only
 } Token;
 
+// Tokens are produced on demand. The parser sees a small window of the
+// most recent ones, so a Token* stays valid for TOKEN_LOOKAHEAD - 1
+// further tokens.
 typedef struct {
-    Token tokens[MAX_TOKENS];
-    int count;
-    int current;
+    const char *p;          // next unread character
+    const char *end;
+    int line;
+    Token ring[TOKEN_LOOKAHEAD];
+    int count;              // tokens produced so far
+    int current;            // index of the parser's next token
 } Tokenizer;
 
 // ============= AST NODE TYPES =============
@@ -64,28 +98,46 @@ typedef enum {
     NODE_BREAK_STMT, NODE_CONTINUE_STMT,
     NODE_BINARY_OP, NODE_UNARY_OP, NODE_ASSIGN,
     NODE_CALL, NODE_LITERAL, NODE_IDENTIFIER,
-    NODE_ARRAY_LIT, NODE_INDEX
+    NODE_ARRAY_LIT, NODE_INDEX,
+    // Specialized binary ops, rewritten from NODE_BINARY_OP at runtime
+    NODE_BINARY_INT, NODE_BINARY_FLOAT, NODE_BINARY_CONCAT,
+    NODE_TYPE_COUNT
 } NodeType;
 
+// Operators are decoded once by the parser. The order matches the
+// OP_ADD..OP_NEQ opcodes of the VM.
+typedef enum {
+    BIN_ADD, BIN_SUB, BIN_MUL, BIN_DIV, BIN_MOD,
+    BIN_GT, BIN_LT, BIN_GTE, BIN_LTE, BIN_EQ, BIN_NEQ,
+    BIN_AND, BIN_OR,
+    BIN_NONE         // plain `=` in NODE_ASSIGN
+} BinaryOp;
+
 typedef struct ASTNode {
     NodeType type;
+    int line;
     union {
         struct { // Program/Block
             struct ASTNode **statements;
             int stmt_count;
         } block;
         struct { // Function
-            char name[MAX_TOKEN_LEN];
-            char **params;
+            Symbol *name;
+            Symbol **params;
             int param_count;
             struct ASTNode *body;
-            char return_type[MAX_TOKEN_LEN];
+            Symbol *return_type;
+            int func_index;  // resolved
+            int slot_count;  // resolved frame size
+            int memo;        // @memo annotation
+            struct MemoCache *cache; // resolved, NULL unless memoized
         } func;
         struct { // Variable
-            char name[MAX_TOKEN_LEN];
+            Symbol *name;
             struct ASTNode *init;
-            char var_type[MAX_TOKEN_LEN];
+            Symbol *var_type;
             int is_const;
+            int slot;        // resolved
         } var;
         struct { // If
             struct ASTNode *condition;
@@ -93,92 +145,165 @@ typedef struct ASTNode {
             struct ASTNode *else_branch;
         } if_stmt;
         struct { // For
-            char iterator[MAX_TOKEN_LEN];
+            Symbol *iterator;
             struct ASTNode *iterable;
             struct ASTNode *body;
+            int slot;        // resolved
         } for_stmt;
         struct { // While
             struct ASTNode *condition;
             struct ASTNode *body;
+            int counting;    // 1 counting loop, -1 general, 0 not yet checked
+            int step;        // counting: amount added to the variable
+            struct ASTNode *counted_body; // counting: body without the step
         } while_stmt;
         struct { // Return
             struct ASTNode *value;
         } return_stmt;
-        struct { // Binary Op
-            char op[MAX_TOKEN_LEN];
+        struct { // Binary Op / Assign
+            BinaryOp op;
             struct ASTNode *left;
             struct ASTNode *right;
+            int generic;     // deoptimized once, stop specializing
         } binary;
         struct { // Call
-            char name[MAX_TOKEN_LEN];
+            Symbol *name;
             struct ASTNode **args;
             int arg_count;
+            int func_index;  // resolved, -1 for builtins
+            struct Builtin *builtin; // resolved when func_index is -1
         } call;
         struct { // Literal
-            char value[MAX_TOKEN_LEN];
-            int is_number;
-            int is_string;
+            int constant;    // index into the constant pool
         } literal;
         struct { // Identifier
-            char name[MAX_TOKEN_LEN];
+            Symbol *name;
+            int depth;       // resolved: frames to walk up
+            int slot;        // resolved: index within that frame
         } identifier;
         struct { // Array
             struct ASTNode **elements;
             int element_count;
         } array;
         struct { // Index
-            char name[MAX_TOKEN_LEN];
+            Symbol *name;
             struct ASTNode *index;
+            int depth;       // resolved
+            int slot;        // resolved
         } index;
     } data;
 } ASTNode;
 
 // ============= RUNTIME VALUES =============
 typedef enum {
-    VAL_INT, VAL_FLOAT, VAL_STRING, VAL_BOOL, VAL_ARRAY, VAL_NULL
+    VAL_INT, VAL_FLOAT, VAL_STRING, VAL_BOOL, VAL_ARRAY, VAL_NULL, VAL_ITERATOR
 } ValueType;
 
+typedef enum {
+    OBJ_STRING, OBJ_ARRAY, OBJ_BUFFER, OBJ_ITERATOR,
+    OBJ_TYPE_COUNT
+} ObjType;
+
+// Header shared by every garbage-collected object.
+typedef struct Obj {
+    ObjType type;
+    int marked;
+    size_t size;             // bytes charged to the heap
+    struct Obj *next;        // every live object, for the sweep
+} Obj;
+
+// Growable storage behind strings built by concatenation. Strings are
+// immutable prefixes of it: appending to the string that ends at
+// `length` writes in place, and a full buffer is replaced rather than
+// reallocated so every string's chars stay put.
+typedef struct {
+    Obj obj;
+    int length;              // bytes in use
+    int capacity;
+    char data[];
+} ObjBuffer;
+
+// Strings are not necessarily NUL-terminated (a longer string may share
+// the buffer), so always use `length`.
+typedef struct {
+    Obj obj;
+    int length;
+    char *chars;             // right after the header, or into `buf`
+    ObjBuffer *buf;          // NULL unless built by concatenation
+} ObjString;
+
+// Arrays hold their elements inline. All-int and all-float arrays are
+// packed as raw numbers; anything else stores full Values.
+typedef enum {
+    ARRAY_INT, ARRAY_FLOAT, ARRAY_VALUE
+} ArrayKind;
+
+typedef struct {
+    Obj obj;
+    ArrayKind kind;
+    int count;
+    union {
+        int *ints;
+        double *floats;
+        struct Value *values;
+        void *items;         // right after the header
+    } data;
+} ObjArray;
+
+// Lazy sequences for for-loops. The loop keeps the position, so a range
+// can be walked any number of times; lines() consumes stdin as it goes.
+typedef enum {
+    ITER_RANGE,
+    ITER_LINES
+} IterKind;
+
+typedef struct {
+    Obj obj;
+    IterKind kind;
+    int start, step, count;  // ITER_RANGE
+} ObjIterator;
+
 typedef struct Value {
     ValueType type;
     union {
         int int_val;
         double float_val;
-        char *string_val;
+        ObjString *string_val;
         int bool_val;
-        struct {
-            struct Value **elements;
-            int count;
-        } array_val;
+        ObjArray *array_val;
+        ObjIterator *iter_val;
     } data;
 } Value;
 
 typedef struct {
-    char name[MAX_TOKEN_LEN];
-    Value value;
-    int is_const;
-} Variable;
-
-
-typedef struct {
-    char name[MAX_TOKEN_LEN];
-    char **params;
+    Symbol *name;
     int param_count;
+    int slot_count;
     ASTNode *body;
+    int defined;     // set once the declaration has executed
+    struct MemoCache *memo;  // result cache of the current declaration
 } Function;
 
-typedef struct {
-    Variable vars[MAX_VARS];
-    int var_count;
-    Function funcs[MAX_FUNCS];
-    int func_count;
-} Environment;
-
 // ============= GLOBAL STATE =============
-Environment global_env;
-int return_flag = 0;
-Value return_value;
-int break_flag = 0;
-int continue_flag = 0;
+Function *funcs = NULL;
+int func_count = 0;
+int max_call_depth = 1000000;    // nested user calls allowed, 0 for no limit
+
+// Counters reported by --stats. They are always kept; each is a single
+// add on a path that already does more work.
+long stat_tokens = 0;
+long stat_evals[NODE_TYPE_COUNT];    // tree-walker evaluations by node type
+long stat_symbol_lookups = 0;        // intern() calls
+long stat_symbol_compares = 0;       // names compared by intern()
+long stat_scope_lookups = 0;         // resolver variable lookups
+long stat_scope_compares = 0;
+long stat_func_lookups = 0;          // resolver function lookups
+long stat_func_compares = 0;
+long stat_objects[OBJ_TYPE_COUNT];   // heap allocations by type
+long stat_object_bytes[OBJ_TYPE_COUNT];
+long stat_peak_stack = 0;            // value stack slots in use
+long stat_peak_depth = 0;            // call frames
+long stat_largest_array = 0;
 
 // ============= ASCII LOGO =============
 void show_logo() {
@@ -196,169 +321,510 @@ void show_logo() {
 
 // ============= UTILITY FUNCTIONS =============
 void error_at_token(const char *msg, Token *t) {
-    fprintf(stderr, "Error: %s (line %d, token='%s', type=%d)\n",
-            msg, t ? t->line : -1, t ? t->value : "?", t ? t->type : -1);
+    fprintf(stderr, "Error: %s (line %d, token='%.*s', type=%d)\n",
+            msg, t ? t->line : -1, t ? t->length : 1, t ? t->start : "?", t ? t->type : -1);
     exit(1);
 }
 
 
-char* read_file(const char *filename) {
-    FILE *file = fopen(filename, "r");
+// The source is mapped read-only and tokens point straight into it. It is
+// not NUL-terminated; everything that scans it is bounded by `size`.
+// "-" reads it from stdin.
+const char* map_file(const char *filename, size_t *size) {
+    int from_stdin = strcmp(filename, "-") == 0;
+#ifndef _WIN32
+    int fd = from_stdin ? -1 : open(filename, O_RDONLY);
+    if (fd < 0 && !from_stdin) {
+        fprintf(stderr, "Error: Cannot open file '%s'\n", filename);
+        exit(1);
+    }
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        *size = st.st_size;
+        const char *content = "";
+        if (*size > 0) {
+            content = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (content == MAP_FAILED) {
+                fprintf(stderr, "Error: Cannot map file '%s'\n", filename);
+                exit(1);
+            }
+        }
+        close(fd);
+        return content;
+    }
+    if (fd >= 0) close(fd);
+#endif
+    // Pipes, stdin and platforms without mmap: read it into memory
+    FILE *file = from_stdin ? stdin : fopen(filename, "rb");
     if (!file) {
         fprintf(stderr, "Error: Cannot open file '%s'\n", filename);
         exit(1);
     }
-    
-    fseek(file, 0, SEEK_END);
-    long size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    
-    char *content = malloc(size + 1);
-    fread(content, 1, size, file);
-    content[size] = '\0';
-    fclose(file);
-    
+    size_t capacity = 4096;
+    char *content = malloc(capacity);
+    *size = 0;
+    size_t n;
+    while ((n = fread(content + *size, 1, capacity - *size, file)) > 0) {
+        *size += n;
+        if (*size == capacity) content = realloc(content, capacity *= 2);
+    }
+    if (!from_stdin) fclose(file);
     return content;
 }
 
-// ============= TOKENIZER =============
-int is_keyword(const char *str, TokenType *type) {
-    if (strcmp(str, "break") == 0) { *type = TOK_BREAK; return 1; }
-    if (strcmp(str, "continue") == 0) { *type = TOK_CONTINUE; return 1; }
-    if (strcmp(str, "func") == 0) { *type = TOK_FUNC; return 1; }
-    if (strcmp(str, "let") == 0) { *type = TOK_LET; return 1; }
-    if (strcmp(str, "const") == 0) { *type = TOK_CONST; return 1; }
-    if (strcmp(str, "if") == 0) { *type = TOK_IF; return 1; }
-    if (strcmp(str, "else") == 0) { *type = TOK_ELSE; return 1; }
-    if (strcmp(str, "for") == 0) { *type = TOK_FOR; return 1; }
-    if (strcmp(str, "while") == 0) { *type = TOK_WHILE; return 1; }
-    if (strcmp(str, "return") == 0) { *type = TOK_RETURN; return 1; }
-    if (strcmp(str, "in") == 0) { *type = TOK_IN; return 1; }
-    if (strcmp(str, "true") == 0) { *type = TOK_TRUE; return 1; }
-    if (strcmp(str, "false") == 0) { *type = TOK_FALSE; return 1; }
+// Parses a byte count with an optional K, M or G suffix. Returns 0 if
+// the text is not a valid positive size.
+size_t parse_size(const char *text) {
+    char *end;
+    double size = strtod(text, &end);
+    if (end == text || size <= 0) return 0;
+    switch (*end) {
+        case 'k': case 'K': size *= 1024; end++; break;
+        case 'm': case 'M': size *= 1024 * 1024; end++; break;
+        case 'g': case 'G': size *= 1024.0 * 1024 * 1024; end++; break;
+    }
+    if (*end != '\0') return 0;
+    return (size_t)size;
+}
+
+// Bump allocator for data that lives as long as the program: the AST and
+// the symbol table. Nothing is freed individually.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+    size_t bytes;            // total handed out
+} Arena;
+
+Arena ast_arena;
+
+void* arena_alloc(Arena *arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    ArenaBlock *block = arena->head;
+    if (!block || block->used + size > block->capacity) {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + capacity);
+        block->used = 0;
+        block->capacity = capacity;
+        block->next = arena->head;
+        arena->head = block;
+    }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    arena->bytes += size;
+    return ptr;
+}
+
+// ============= VALUES =============
+Value create_int(int val) {
+    Value v;
+    v.type = VAL_INT;
+    v.data.int_val = val;
+    return v;
+}
+
+Value create_float(double val) {
+    Value v;
+    v.type = VAL_FLOAT;
+    v.data.float_val = val;
+    return v;
+}
+
+// Allocation only records that a collection is due; the interpreter
+// collects at its next safe point, where every live value is rooted.
+#define GC_MIN_THRESHOLD (1024 * 1024)
+
+Obj *gc_objects = NULL;
+size_t gc_bytes = 0;              // currently allocated
+size_t gc_next_collection = GC_MIN_THRESHOLD;
+size_t gc_max_heap = 0;           // --max-heap, 0 for unlimited
+int gc_pending = 0;
+
+// Reported by --gc-stats
+size_t gc_allocations = 0;
+size_t gc_total_allocated = 0;
+size_t gc_total_freed = 0;
+size_t gc_peak = 0;
+int gc_collections = 0;
+double gc_pause_ms = 0;
+
+Obj* gc_alloc(size_t size, ObjType type) {
+    Obj *obj = malloc(size);
+    obj->type = type;
+    obj->marked = 0;
+    obj->size = size;
+    obj->next = gc_objects;
+    gc_objects = obj;
+    gc_bytes += size;
+    gc_allocations++;
+    stat_objects[type]++;
+    stat_object_bytes[type] += size;
+    gc_total_allocated += size;
+    if (gc_bytes > gc_peak) gc_peak = gc_bytes;
+    if (gc_bytes > gc_next_collection) gc_pending = 1;
+    return obj;
+}
+
+// Fresh string of `length` bytes; the caller fills in the characters.
+ObjString* new_string(int length) {
+    ObjString *str = (ObjString*)gc_alloc(sizeof(ObjString) + length + 1, OBJ_STRING);
+    str->length = length;
+    str->chars = (char*)(str + 1);
+    str->chars[length] = '\0';
+    str->buf = NULL;
+    return str;
+}
+
+Value string_value(ObjString *str) {
+    Value v;
+    v.type = VAL_STRING;
+    v.data.string_val = str;
+    return v;
+}
+
+Value create_string_span(const char *chars, int length) {
+    ObjString *str = new_string(length);
+    memcpy(str->chars, chars, length);
+    return string_value(str);
+}
+
+Value create_string(const char *val) {
+    return create_string_span(val, strlen(val));
+}
+
+Value create_bool(int val) {
+    Value v;
+    v.type = VAL_BOOL;
+    v.data.bool_val = val;
+    return v;
+}
+
+Value create_null() {
+    Value v;
+    v.type = VAL_NULL;
+    return v;
+}
+
+size_t array_item_size(ArrayKind kind) {
+    switch (kind) {
+        case ARRAY_INT: return sizeof(int);
+        case ARRAY_FLOAT: return sizeof(double);
+        default: return sizeof(Value);
+    }
+}
+
+// Array of `count` elements with the given storage; the caller fills it
+// in before the next safe point.
+Value create_array(ArrayKind kind, int count) {
+    ObjArray *arr = (ObjArray*)gc_alloc(sizeof(ObjArray) + count * array_item_size(kind), OBJ_ARRAY);
+    if (count > stat_largest_array) stat_largest_array = count;
+    arr->kind = kind;
+    arr->count = count;
+    arr->data.items = arr + 1;
+    Value v;
+    v.type = VAL_ARRAY;
+    v.data.array_val = arr;
+    return v;
+}
+
+// Array of the given values, packed when they are all ints or all floats.
+Value create_array_from(Value *items, int count) {
+    ArrayKind kind = count > 0 && items[0].type == VAL_FLOAT ? ARRAY_FLOAT : ARRAY_INT;
+    for (int i = 0; i < count; i++) {
+        if (items[i].type != (kind == ARRAY_INT ? VAL_INT : VAL_FLOAT)) {
+            kind = ARRAY_VALUE;
+            break;
+        }
+    }
+    Value v = create_array(kind, count);
+    ObjArray *arr = v.data.array_val;
+    for (int i = 0; i < count; i++) {
+        switch (kind) {
+            case ARRAY_INT: arr->data.ints[i] = items[i].data.int_val; break;
+            case ARRAY_FLOAT: arr->data.floats[i] = items[i].data.float_val; break;
+            default: arr->data.values[i] = items[i]; break;
+        }
+    }
+    return v;
+}
+
+Value array_get(ObjArray *arr, int i) {
+    switch (arr->kind) {
+        case ARRAY_INT: return create_int(arr->data.ints[i]);
+        case ARRAY_FLOAT: return create_float(arr->data.floats[i]);
+        default: return arr->data.values[i];
+    }
+}
+
+// range(start, stop, step): count is worked out up front in 64 bits, so
+// the elements never overflow.
+Value create_iterator(IterKind kind) {
+    ObjIterator *it = (ObjIterator*)gc_alloc(sizeof(ObjIterator), OBJ_ITERATOR);
+    it->kind = kind;
+    Value v;
+    v.type = VAL_ITERATOR;
+    v.data.iter_val = it;
+    return v;
+}
+
+Value create_range(int start, int stop, int step) {
+    Value v = create_iterator(ITER_RANGE);
+    ObjIterator *it = v.data.iter_val;
+    long long span = step > 0 ? (long long)stop - start : (long long)start - stop;
+    long long stride = step > 0 ? step : -(long long)step;
+    it->start = start;
+    it->step = step;
+    it->count = span > 0 ? (int)((span + stride - 1) / stride) : 0;
+    return v;
+}
+
+int read_line(Value *out);
+
+// Iteration protocol shared by both engines: *pos starts at 0 and is
+// owned by the loop. Returns 0 once the sequence is exhausted. Values
+// that are not iterable are empty.
+int iter_next(Value iterable, int *pos, Value *out) {
+    if (iterable.type == VAL_ARRAY) {
+        if (*pos >= iterable.data.array_val->count) return 0;
+        *out = array_get(iterable.data.array_val, (*pos)++);
+        return 1;
+    }
+    if (iterable.type == VAL_ITERATOR) {
+        ObjIterator *it = iterable.data.iter_val;
+        switch (it->kind) {
+            case ITER_RANGE:
+                if (*pos >= it->count) return 0;
+                *out = create_int((int)(it->start + (long long)(*pos)++ * it->step));
+                return 1;
+            case ITER_LINES:
+                return read_line(out);
+        }
+    }
     return 0;
 }
 
-void tokenize(const char *source, Tokenizer *tok) {
+int is_object(Value v) {
+    return v.type == VAL_STRING || v.type == VAL_ARRAY || v.type == VAL_ITERATOR;
+}
+
+void gc_collect();
+
+// Literals are converted once by the parser into ready-made Values.
+// String constants are shared and never modified.
+Value *constants = NULL;
+int constant_count = 0;
+int constant_capacity = 0;
+
+int add_constant(Value v) {
+    if (constant_count == constant_capacity) {
+        constant_capacity = constant_capacity ? constant_capacity * 2 : 64;
+        constants = realloc(constants, sizeof(Value) * constant_capacity);
+    }
+    constants[constant_count] = v;
+    return constant_count++;
+}
+
+// ============= SYMBOLS =============
+Symbol **symbol_table = NULL;
+int symbol_capacity = 0;
+int symbol_count = 0;
+
+unsigned hash_name(const char *s, int len) {
+    unsigned h = 2166136261u; // FNV-1a
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void grow_symbol_table() {
+    int capacity = symbol_capacity ? symbol_capacity * 2 : 256;
+    Symbol **table = calloc(capacity, sizeof(Symbol*));
+    for (int i = 0; i < symbol_capacity; i++) {
+        Symbol *sym = symbol_table[i];
+        while (sym) {
+            Symbol *next = sym->next;
+            sym->next = table[sym->hash & (capacity - 1)];
+            table[sym->hash & (capacity - 1)] = sym;
+            sym = next;
+        }
+    }
+    free(symbol_table);
+    symbol_table = table;
+    symbol_capacity = capacity;
+}
+
+// Returns the unique Symbol for name[0..len), creating it on first use.
+Symbol* intern(const char *name, int len) {
+    unsigned h = hash_name(name, len);
+    stat_symbol_lookups++;
+    if (symbol_capacity) {
+        for (Symbol *sym = symbol_table[h & (symbol_capacity - 1)]; sym; sym = sym->next) {
+            stat_symbol_compares++;
+            if (sym->hash == h && sym->length == len && memcmp(sym->name, name, len) == 0) return sym;
+        }
+    }
+    if (symbol_count >= symbol_capacity * 3 / 4) grow_symbol_table();
+    
+    Symbol *sym = arena_alloc(&ast_arena, sizeof(Symbol));
+    char *copy = arena_alloc(&ast_arena, len + 1);
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    sym->name = copy;
+    sym->length = len;
+    sym->hash = h;
+    sym->keyword = TOK_IDENTIFIER;
+    sym->builtin = NULL;
+    sym->serial = 0;
+    sym->next = symbol_table[h & (symbol_capacity - 1)];
+    symbol_table[h & (symbol_capacity - 1)] = sym;
+    symbol_count++;
+    return sym;
+}
+
+void init_symbols() {
+    static const struct { const char *name; TokenType type; } keywords[] = {
+        {"break", TOK_BREAK}, {"continue", TOK_CONTINUE}, {"func", TOK_FUNC},
+        {"let", TOK_LET}, {"const", TOK_CONST}, {"if", TOK_IF}, {"else", TOK_ELSE},
+        {"for", TOK_FOR}, {"while", TOK_WHILE}, {"return", TOK_RETURN},
+        {"in", TOK_IN}, {"true", TOK_TRUE}, {"false", TOK_FALSE}
+    };
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+        intern(keywords[i].name, strlen(keywords[i].name))->keyword = keywords[i].type;
+    }
+}
+
+// ============= TOKENIZER =============
+
+void init_tokenizer(Tokenizer *tok, const char *source, size_t size) {
+    tok->p = source;
+    tok->end = source + size;
+    tok->line = 1;
     tok->count = 0;
     tok->current = 0;
-    int line = 1;
-    const char *p = source;
+}
+
+// Scans the next token from the source. At the end of input it keeps
+// returning TOK_EOF.
+void next_token(Tokenizer *tok, Token *token) {
+    const char *p = tok->p, *end = tok->end;
     
-    while (*p) {
+    while (p < end) {
         // Skip whitespace
-        while (*p && isspace(*p)) {
-            if (*p == '\n') line++;
+        if (isspace((unsigned char)*p)) {
+            if (*p == '\n') tok->line++;
             p++;
         }
-        if (!*p) break;
-        
         // Skip comments
-        if (*p == '#') {
-            while (*p && *p != '\n') p++;
-            continue;
+        else if (*p == '#') {
+            while (p < end && *p != '\n') p++;
         }
-        
-        Token *token = &tok->tokens[tok->count++];
-        token->line = line;
-        
-        // String literals (supports "..." and '...')
-        if (*p == '"' || *p == '\'') {
-            char quote = *p;
+        else break;
+    }
+    
+    token->line = tok->line;
+    token->start = p;
+    token->sym = NULL;
+    
+    if (p == end) {
+        token->type = TOK_EOF;
+        token->length = 0;
+        tok->p = p;
+        return;
+    }
+    
+    // String literals (supports "..." and '...')
+    if (*p == '"' || *p == '\'') {
+        char quote = *p++;
+        token->start = p;
+        while (p < end && *p != quote) {
+            if (*p == '\n') tok->line++;
             p++;
-            int i = 0;
-            while (*p && *p != quote && i < MAX_TOKEN_LEN - 1) {
-                token->value[i++] = *p++;
-            }
-            token->value[i] = '\0';
-            if (*p == quote) p++;
-            token->type = TOK_STRING_LIT;
-        }
-
-        // Numbers
-        else if (isdigit(*p)) {
-            int i = 0;
-            while ((isdigit(*p) || *p == '.') && i < MAX_TOKEN_LEN - 1) {
-                token->value[i++] = *p++;
-            }
-            token->value[i] = '\0';
-            token->type = TOK_NUMBER;
-        }
-        // Identifiers and keywords
-        else if (isalpha(*p) || *p == '_') {
-            int i = 0;
-            while ((isalnum(*p) || *p == '_') && i < MAX_TOKEN_LEN - 1) {
-                token->value[i++] = *p++;
-            }
-            token->value[i] = '\0';
-            TokenType kw_type;
-            if (is_keyword(token->value, &kw_type)) {
-                token->type = kw_type;
-            } else {
-                token->type = TOK_IDENTIFIER;
-            }
         }
-        // Operators and punctuation
+        token->length = (int)(p - token->start);
+        if (p < end) p++;
+        token->type = TOK_STRING_LIT;
+    }
+    // Numbers
+    else if (isdigit((unsigned char)*p)) {
+        while (p < end && (isdigit((unsigned char)*p) || *p == '.')) p++;
+        token->length = (int)(p - token->start);
+        token->type = TOK_NUMBER;
+    }
+    // Identifiers and keywords
+    else if (isalpha((unsigned char)*p) || *p == '_') {
+        while (p < end && (isalnum((unsigned char)*p) || *p == '_')) p++;
+        token->length = (int)(p - token->start);
+        token->sym = intern(token->start, token->length);
+        token->type = token->sym->keyword;
+    }
+    // Operators and punctuation
+    else {
+        char c = *p, next = p + 1 < end ? p[1] : '\0';
+        int two = 1;
+        
+        if (c == '+' && next == '=') token->type = TOK_PLUS_ASSIGN;
+        else if (c == '-' && next == '=') token->type = TOK_MINUS_ASSIGN;
+        else if (c == '-' && next == '>') token->type = TOK_ARROW;
+        else if (c == '=' && next == '=') token->type = TOK_EQ;
+        else if (c == '!' && next == '=') token->type = TOK_NEQ;
+        else if (c == '<' && next == '=') token->type = TOK_LTE;
+        else if (c == '>' && next == '=') token->type = TOK_GTE;
+        else if (c == '&' && next == '&') token->type = TOK_AND;
+        else if (c == '|' && next == '|') token->type = TOK_OR;
         else {
-            token->value[0] = *p;
-            token->value[1] = '\0';
-            
-            if (*p == '+') {
-                if (*(p+1) == '=') { token->type = TOK_PLUS_ASSIGN; p++; token->value[1] = '='; token->value[2] = '\0'; }
-                else token->type = TOK_PLUS;
-            }
-            else if (*p == '-') {
-                if (*(p+1) == '=') { token->type = TOK_MINUS_ASSIGN; p++; token->value[1] = '='; token->value[2] = '\0'; }
-                else if (*(p+1) == '>') { token->type = TOK_ARROW; p++; token->value[1] = '>'; token->value[2] = '\0'; }
-                else token->type = TOK_MINUS;
-            }
-            else if (*p == '*') token->type = TOK_MULT;
-            else if (*p == '/') token->type = TOK_DIV;
-            else if (*p == '%') token->type = TOK_MOD;
-            else if (*p == '=') {
-                if (*(p+1) == '=') { token->type = TOK_EQ; p++; token->value[1] = '='; token->value[2] = '\0'; }
-                else token->type = TOK_ASSIGN;
-            }
-            else if (*p == '!') {
-                if (*(p+1) == '=') { token->type = TOK_NEQ; p++; token->value[1] = '='; token->value[2] = '\0'; }
-                else token->type = TOK_NOT;
-            }
-            else if (*p == '<') {
-                if (*(p+1) == '=') { token->type = TOK_LTE; p++; token->value[1] = '='; token->value[2] = '\0'; }
-                else token->type = TOK_LT;
-            }
-            else if (*p == '>') {
-                if (*(p+1) == '=') { token->type = TOK_GTE; p++; token->value[1] = '='; token->value[2] = '\0'; }
-                else token->type = TOK_GT;
-            }
-            else if (*p == '&' && *(p+1) == '&') { token->type = TOK_AND; p++; token->value[1] = '&'; token->value[2] = '\0'; }
-            else if (*p == '|' && *(p+1) == '|') { token->type = TOK_OR; p++; token->value[1] = '|'; token->value[2] = '\0'; }
-            else if (*p == '(') token->type = TOK_LPAREN;
-            else if (*p == ')') token->type = TOK_RPAREN;
-            else if (*p == '{') token->type = TOK_LBRACE;
-            else if (*p == '}') token->type = TOK_RBRACE;
-            else if (*p == '[') token->type = TOK_LBRACK;
-            else if (*p == ']') token->type = TOK_RBRACK;
-            else if (*p == ';') token->type = TOK_SEMICOLON;
-            else if (*p == ':') token->type = TOK_COLON;
-            else if (*p == ',') token->type = TOK_COMMA;
-            else if (*p == '.') token->type = TOK_DOT;
-            else token->type = TOK_ERROR;
-            
-            p++;
+            two = 0;
+            switch (c) {
+                case '+': token->type = TOK_PLUS; break;
+                case '-': token->type = TOK_MINUS; break;
+                case '*': token->type = TOK_MULT; break;
+                case '/': token->type = TOK_DIV; break;
+                case '%': token->type = TOK_MOD; break;
+                case '=': token->type = TOK_ASSIGN; break;
+                case '!': token->type = TOK_NOT; break;
+                case '<': token->type = TOK_LT; break;
+                case '>': token->type = TOK_GT; break;
+                case '(': token->type = TOK_LPAREN; break;
+                case ')': token->type = TOK_RPAREN; break;
+                case '{': token->type = TOK_LBRACE; break;
+                case '}': token->type = TOK_RBRACE; break;
+                case '[': token->type = TOK_LBRACK; break;
+                case ']': token->type = TOK_RBRACK; break;
+                case ';': token->type = TOK_SEMICOLON; break;
+                case ':': token->type = TOK_COLON; break;
+                case ',': token->type = TOK_COMMA; break;
+                case '.': token->type = TOK_DOT; break;
+                case '@': token->type = TOK_AT; break;
+                default: token->type = TOK_ERROR; break;
+            }
         }
+        p += 1 + two;
+        token->length = 1 + two;
     }
     
-    tok->tokens[tok->count].type = TOK_EOF;
+    tok->p = p;
 }
 
 // ============= PARSER =============
 Token* peek(Tokenizer *tok) {
-    return &tok->tokens[tok->current];
+    if (tok->current == tok->count) {
+        next_token(tok, &tok->ring[tok->count++ % TOKEN_LOOKAHEAD]);
+    }
+    return &tok->ring[tok->current % TOKEN_LOOKAHEAD];
 }
 
 Token* advance(Tokenizer *tok) {
-    return &tok->tokens[tok->current++];
+    Token *t = peek(tok);
+    tok->current++;
+    return t;
 }
 
 int match(Tokenizer *tok, TokenType type) {
@@ -372,34 +838,100 @@ int match(Tokenizer *tok, TokenType type) {
 ASTNode* parse_expression(Tokenizer *tok);
 ASTNode* parse_statement(Tokenizer *tok);
 
+Token* expect_identifier(Tokenizer *tok) {
+    Token *t = advance(tok);
+    if (t->type != TOK_IDENTIFIER) error_at_token("Expected identifier", t);
+    return t;
+}
+
+long ast_node_count = 0;
+
+ASTNode* alloc_node(int line) {
+    ASTNode *node = arena_alloc(&ast_arena, sizeof(ASTNode));
+    ast_node_count++;
+    memset(node, 0, sizeof(ASTNode));
+    node->line = line;
+    return node;
+}
+
+// Child lists are gathered on a shared scratch stack while they are
+// parsed (nested lists stack on top of each other) and then copied into
+// the arena at their exact size.
+void **parse_scratch = NULL;
+int parse_scratch_count = 0;
+int parse_scratch_capacity = 0;
+
+void scratch_push(void *item) {
+    if (parse_scratch_count == parse_scratch_capacity) {
+        parse_scratch_capacity = parse_scratch_capacity ? parse_scratch_capacity * 2 : 256;
+        parse_scratch = realloc(parse_scratch, sizeof(void*) * parse_scratch_capacity);
+    }
+    parse_scratch[parse_scratch_count++] = item;
+}
+
+// Moves everything pushed since `start` into the arena.
+void* scratch_finish(int start, int *count) {
+    *count = parse_scratch_count - start;
+    void **list = arena_alloc(&ast_arena, sizeof(void*) * (*count > 0 ? *count : 1));
+    memcpy(list, parse_scratch + start, sizeof(void*) * *count);
+    parse_scratch_count = start;
+    return list;
+}
+
+// Comma-separated expressions up to `close`, which is consumed.
+ASTNode** parse_expression_list(Tokenizer *tok, TokenType close, int *count) {
+    int start = parse_scratch_count;
+    while (peek(tok)->type != close && peek(tok)->type != TOK_EOF) {
+        scratch_push(parse_expression(tok));
+        if (peek(tok)->type == TOK_COMMA) advance(tok);
+    }
+    match(tok, close);
+    return scratch_finish(start, count);
+}
+
+// Statements up to the closing brace, which is consumed.
+ASTNode* parse_block(Tokenizer *tok, int line) {
+    ASTNode *block = alloc_node(line);
+    block->type = NODE_BLOCK;
+    int start = parse_scratch_count;
+    while (peek(tok)->type != TOK_RBRACE && peek(tok)->type != TOK_EOF) {
+        ASTNode *stmt = parse_statement(tok);
+        if (stmt) scratch_push(stmt);
+    }
+    match(tok, TOK_RBRACE);
+    block->data.block.statements = scratch_finish(start, &block->data.block.stmt_count);
+    return block;
+}
+
 ASTNode* parse_primary(Tokenizer *tok) {
     Token *t = peek(tok);
-    ASTNode *node = malloc(sizeof(ASTNode));
+    ASTNode *node = alloc_node(t->line);
     
     if (t->type == TOK_NUMBER) {
         advance(tok);
         node->type = NODE_LITERAL;
-        strcpy(node->data.literal.value, t->value);
-        node->data.literal.is_number = 1;
-        node->data.literal.is_string = 0;
+        char text[t->length + 1];
+        memcpy(text, t->start, t->length);
+        text[t->length] = '\0';
+        if (memchr(text, '.', t->length)) {
+            node->data.literal.constant = add_constant(create_float(atof(text)));
+        } else {
+            node->data.literal.constant = add_constant(create_int(atoi(text)));
+        }
         return node;
     }
     
     if (t->type == TOK_STRING_LIT) {
         advance(tok);
         node->type = NODE_LITERAL;
-        strcpy(node->data.literal.value, t->value);
-        node->data.literal.is_number = 0;
-        node->data.literal.is_string = 1;
+        node->data.literal.constant = add_constant(create_string_span(t->start, t->length));
         return node;
     }
     
     if (t->type == TOK_TRUE || t->type == TOK_FALSE) {
         advance(tok);
         node->type = NODE_LITERAL;
-        strcpy(node->data.literal.value, t->type == TOK_TRUE ? "1" : "0");
-        node->data.literal.is_number = 1;
-        node->data.literal.is_string = 0;
+        node->data.literal.constant = add_constant(create_int(t->type == TOK_TRUE));
         return node;
     }
     
@@ -410,15 +942,8 @@ ASTNode* parse_primary(Tokenizer *tok) {
         if (peek(tok)->type == TOK_LPAREN) {
             advance(tok);
             node->type = NODE_CALL;
-            strcpy(node->data.call.name, t->value);
-            node->data.call.arg_count = 0;
-            node->data.call.args = malloc(sizeof(ASTNode*) * 100);
-            
-            while (peek(tok)->type != TOK_RPAREN && peek(tok)->type != TOK_EOF) {
-                node->data.call.args[node->data.call.arg_count++] = parse_expression(tok);
-                if (peek(tok)->type == TOK_COMMA) advance(tok);
-            }
-            match(tok, TOK_RPAREN);
+            node->data.call.name = t->sym;
+            node->data.call.args = parse_expression_list(tok, TOK_RPAREN, &node->data.call.arg_count);
             return node;
         }
         
@@ -426,7 +951,7 @@ ASTNode* parse_primary(Tokenizer *tok) {
         if (peek(tok)->type == TOK_LBRACK) {
             advance(tok);
             node->type = NODE_INDEX;
-            strcpy(node->data.index.name, t->value);
+            node->data.index.name = t->sym;
             node->data.index.index = parse_expression(tok);
             match(tok, TOK_RBRACK);
             return node;
@@ -434,21 +959,14 @@ ASTNode* parse_primary(Tokenizer *tok) {
         
         // Identifier
         node->type = NODE_IDENTIFIER;
-        strcpy(node->data.identifier.name, t->value);
+        node->data.identifier.name = t->sym;
         return node;
     }
     
     if (t->type == TOK_LBRACK) {
         advance(tok);
         node->type = NODE_ARRAY_LIT;
-        node->data.array.element_count = 0;
-        node->data.array.elements = malloc(sizeof(ASTNode*) * 100);
-        
-        while (peek(tok)->type != TOK_RBRACK && peek(tok)->type != TOK_EOF) {
-            node->data.array.elements[node->data.array.element_count++] = parse_expression(tok);
-            if (peek(tok)->type == TOK_COMMA) advance(tok);
-        }
-        match(tok, TOK_RBRACK);
+        node->data.array.elements = parse_expression_list(tok, TOK_RBRACK, &node->data.array.element_count);
         return node;
     }
     
@@ -464,6 +982,25 @@ ASTNode* parse_primary(Tokenizer *tok) {
 
 }
 
+BinaryOp token_binary_op(TokenType type) {
+    switch (type) {
+        case TOK_PLUS: case TOK_PLUS_ASSIGN: return BIN_ADD;
+        case TOK_MINUS: case TOK_MINUS_ASSIGN: return BIN_SUB;
+        case TOK_MULT: return BIN_MUL;
+        case TOK_DIV: return BIN_DIV;
+        case TOK_MOD: return BIN_MOD;
+        case TOK_GT: return BIN_GT;
+        case TOK_LT: return BIN_LT;
+        case TOK_GTE: return BIN_GTE;
+        case TOK_LTE: return BIN_LTE;
+        case TOK_EQ: return BIN_EQ;
+        case TOK_NEQ: return BIN_NEQ;
+        case TOK_AND: return BIN_AND;
+        case TOK_OR: return BIN_OR;
+        default: return BIN_NONE;
+    }
+}
+
 ASTNode* parse_binary(Tokenizer *tok) {
     ASTNode *left = parse_primary(tok);
     
@@ -474,14 +1011,15 @@ ASTNode* parse_binary(Tokenizer *tok) {
            peek(tok)->type == TOK_GT || peek(tok)->type == TOK_LTE ||
            peek(tok)->type == TOK_GTE || peek(tok)->type == TOK_AND ||
            peek(tok)->type == TOK_OR) {
+        // The operator token may leave the lookahead window while the
+        // right operand is parsed, so take what is needed from it first
         Token *op = advance(tok);
-        ASTNode *right = parse_primary(tok);
-        
-        ASTNode *node = malloc(sizeof(ASTNode));
+        ASTNode *node = alloc_node(op->line);
         node->type = NODE_BINARY_OP;
-        strcpy(node->data.binary.op, op->value);
+        node->data.binary.op = token_binary_op(op->type);
         node->data.binary.left = left;
-        node->data.binary.right = right;
+        node->data.binary.right = parse_primary(tok);
+        node->data.binary.generic = 0;
         left = node;
     }
     
@@ -494,7 +1032,7 @@ ASTNode* parse_expression(Tokenizer *tok) {
 
 ASTNode* parse_statement(Tokenizer *tok) {
     Token *t = peek(tok);
-    ASTNode *node = malloc(sizeof(ASTNode));
+    ASTNode *node = alloc_node(t->line);
 
     // Break statement
     if (t->type == TOK_BREAK) {
@@ -522,38 +1060,37 @@ ASTNode* parse_statement(Tokenizer *tok) {
         match(tok, TOK_RPAREN);
 
         match(tok, TOK_LBRACE);
-
-        node->data.while_stmt.body = malloc(sizeof(ASTNode));
-        node->data.while_stmt.body->type = NODE_BLOCK;
-        node->data.while_stmt.body->data.block.stmt_count = 0;
-        node->data.while_stmt.body->data.block.statements = malloc(sizeof(ASTNode*) * 1000);
-
-        while (peek(tok)->type != TOK_RBRACE && peek(tok)->type != TOK_EOF) {
-            node->data.while_stmt.body->data.block.statements[
-                node->data.while_stmt.body->data.block.stmt_count++
-            ] = parse_statement(tok);
-        }
-
-        match(tok, TOK_RBRACE);
+        node->data.while_stmt.body = parse_block(tok, node->line);
         return node;
     }
 
     
+    // Annotated function declaration: @memo func ...
+    if (t->type == TOK_AT) {
+        advance(tok);
+        Token *name = expect_identifier(tok);
+        if (name->length != 4 || memcmp(name->start, "memo", 4) != 0) {
+            error_at_token("Unknown annotation", name);
+        }
+        if (peek(tok)->type != TOK_FUNC) error_at_token("Expected function after annotation", peek(tok));
+        ASTNode *func = parse_statement(tok);
+        func->data.func.memo = 1;
+        return func;
+    }
+
     // Function declaration
     if (t->type == TOK_FUNC) {
         advance(tok);
         node->type = NODE_FUNC_DECL;
-        Token *name = advance(tok);
-        strcpy(node->data.func.name, name->value);
+        Token *name = expect_identifier(tok);
+        node->data.func.name = name->sym;
         
         match(tok, TOK_LPAREN);
-        node->data.func.param_count = 0;
-        node->data.func.params = malloc(sizeof(char*) * 100);
+        int start = parse_scratch_count;
         
         while (peek(tok)->type != TOK_RPAREN && peek(tok)->type != TOK_EOF) {
-            Token *param = advance(tok);
-            node->data.func.params[node->data.func.param_count] = malloc(MAX_TOKEN_LEN);
-            strcpy(node->data.func.params[node->data.func.param_count++], param->value);
+            Token *param = expect_identifier(tok);
+            scratch_push(param->sym);
             
             if (peek(tok)->type == TOK_COLON) {
                 advance(tok);
@@ -562,24 +1099,16 @@ ASTNode* parse_statement(Tokenizer *tok) {
             if (peek(tok)->type == TOK_COMMA) advance(tok);
         }
         match(tok, TOK_RPAREN);
+        node->data.func.params = scratch_finish(start, &node->data.func.param_count);
         
         if (peek(tok)->type == TOK_ARROW) {
             advance(tok);
             Token *ret_type = advance(tok);
-            strcpy(node->data.func.return_type, ret_type->value);
+            node->data.func.return_type = ret_type->sym;
         }
         
         match(tok, TOK_LBRACE);
-        node->data.func.body = malloc(sizeof(ASTNode));
-        node->data.func.body->type = NODE_BLOCK;
-        node->data.func.body->data.block.stmt_count = 0;
-        node->data.func.body->data.block.statements = malloc(sizeof(ASTNode*) * 1000);
-        
-        while (peek(tok)->type != TOK_RBRACE && peek(tok)->type != TOK_EOF) {
-            node->data.func.body->data.block.statements[node->data.func.body->data.block.stmt_count++] = parse_statement(tok);
-        }
-        match(tok, TOK_RBRACE);
-        
+        node->data.func.body = parse_block(tok, node->line);
         return node;
     }
     
@@ -589,13 +1118,13 @@ ASTNode* parse_statement(Tokenizer *tok) {
         node->type = NODE_VAR_DECL;
         node->data.var.is_const = (t->type == TOK_CONST);
         
-        Token *name = advance(tok);
-        strcpy(node->data.var.name, name->value);
+        Token *name = expect_identifier(tok);
+        node->data.var.name = name->sym;
         
         if (peek(tok)->type == TOK_COLON) {
             advance(tok);
             Token *type_tok = advance(tok);
-            strcpy(node->data.var.var_type, type_tok->value);
+            node->data.var.var_type = type_tok->sym;
         }
         
         match(tok, TOK_ASSIGN);
@@ -613,31 +1142,13 @@ ASTNode* parse_statement(Tokenizer *tok) {
         node->data.if_stmt.condition = parse_expression(tok);
         match(tok, TOK_RPAREN);
         match(tok, TOK_LBRACE);
-        
-        node->data.if_stmt.then_branch = malloc(sizeof(ASTNode));
-        node->data.if_stmt.then_branch->type = NODE_BLOCK;
-        node->data.if_stmt.then_branch->data.block.stmt_count = 0;
-        node->data.if_stmt.then_branch->data.block.statements = malloc(sizeof(ASTNode*) * 1000);
-        
-        while (peek(tok)->type != TOK_RBRACE && peek(tok)->type != TOK_EOF) {
-            node->data.if_stmt.then_branch->data.block.statements[node->data.if_stmt.then_branch->data.block.stmt_count++] = parse_statement(tok);
-        }
-        match(tok, TOK_RBRACE);
+        node->data.if_stmt.then_branch = parse_block(tok, node->line);
         
         node->data.if_stmt.else_branch = NULL;
         if (peek(tok)->type == TOK_ELSE) {
             advance(tok);
             match(tok, TOK_LBRACE);
-            
-            node->data.if_stmt.else_branch = malloc(sizeof(ASTNode));
-            node->data.if_stmt.else_branch->type = NODE_BLOCK;
-            node->data.if_stmt.else_branch->data.block.stmt_count = 0;
-            node->data.if_stmt.else_branch->data.block.statements = malloc(sizeof(ASTNode*) * 1000);
-            
-            while (peek(tok)->type != TOK_RBRACE && peek(tok)->type != TOK_EOF) {
-                node->data.if_stmt.else_branch->data.block.statements[node->data.if_stmt.else_branch->data.block.stmt_count++] = parse_statement(tok);
-            }
-            match(tok, TOK_RBRACE);
+            node->data.if_stmt.else_branch = parse_block(tok, node->line);
         }
         
         return node;
@@ -648,23 +1159,13 @@ ASTNode* parse_statement(Tokenizer *tok) {
         advance(tok);
         node->type = NODE_FOR_STMT;
         match(tok, TOK_LPAREN);
-        Token *iter = advance(tok);
-        strcpy(node->data.for_stmt.iterator, iter->value);
+        Token *iter = expect_identifier(tok);
+        node->data.for_stmt.iterator = iter->sym;
         match(tok, TOK_IN);
         node->data.for_stmt.iterable = parse_expression(tok);
         match(tok, TOK_RPAREN);
         match(tok, TOK_LBRACE);
-        
-        node->data.for_stmt.body = malloc(sizeof(ASTNode));
-        node->data.for_stmt.body->type = NODE_BLOCK;
-        node->data.for_stmt.body->data.block.stmt_count = 0;
-        node->data.for_stmt.body->data.block.statements = malloc(sizeof(ASTNode*) * 1000);
-        
-        while (peek(tok)->type != TOK_RBRACE && peek(tok)->type != TOK_EOF) {
-            node->data.for_stmt.body->data.block.statements[node->data.for_stmt.body->data.block.stmt_count++] = parse_statement(tok);
-        }
-        match(tok, TOK_RBRACE);
-        
+        node->data.for_stmt.body = parse_block(tok, node->line);
         return node;
     }
     
@@ -685,10 +1186,11 @@ ASTNode* parse_statement(Tokenizer *tok) {
             peek(tok)->type == TOK_MINUS_ASSIGN) {
             Token *op = advance(tok);
             node->type = NODE_ASSIGN;
-            strcpy(node->data.binary.op, op->value);
-            node->data.binary.left = malloc(sizeof(ASTNode));
+            node->data.binary.op = token_binary_op(op->type);
+            node->data.binary.generic = 0;
+            node->data.binary.left = alloc_node(name->line);
             node->data.binary.left->type = NODE_IDENTIFIER;
-            strcpy(node->data.binary.left->data.identifier.name, name->value);
+            node->data.binary.left->data.identifier.name = name->sym;
             node->data.binary.right = parse_expression(tok);
             if (peek(tok)->type == TOK_SEMICOLON) advance(tok);
             return node;
@@ -698,435 +1200,5421 @@ ASTNode* parse_statement(Tokenizer *tok) {
         if (peek(tok)->type == TOK_LPAREN) {
             advance(tok);
             node->type = NODE_EXPR_STMT;
-            ASTNode *call = malloc(sizeof(ASTNode));
+            ASTNode *call = alloc_node(name->line);
             call->type = NODE_CALL;
-            strcpy(call->data.call.name, name->value);
-            call->data.call.arg_count = 0;
-            call->data.call.args = malloc(sizeof(ASTNode*) * 100);
-            
-            while (peek(tok)->type != TOK_RPAREN && peek(tok)->type != TOK_EOF) {
-                call->data.call.args[call->data.call.arg_count++] = parse_expression(tok);
-                if (peek(tok)->type == TOK_COMMA) advance(tok);
-            }
-            match(tok, TOK_RPAREN);
+            call->data.call.name = name->sym;
+            call->data.call.args = parse_expression_list(tok, TOK_RPAREN, &call->data.call.arg_count);
             if (peek(tok)->type == TOK_SEMICOLON) advance(tok);
             
-            node->data.block.statements = malloc(sizeof(ASTNode*));
+            node->data.block.statements = arena_alloc(&ast_arena, sizeof(ASTNode*));
             node->data.block.statements[0] = call;
             node->data.block.stmt_count = 1;
             return node;
         }
     }
     
-    free(node);
+    // Not a statement; the node stays unused in the arena
     return NULL;
 }
 
 
 ASTNode* parse_program(Tokenizer *tok) {
-    ASTNode *program = malloc(sizeof(ASTNode));
+    ASTNode *program = alloc_node(1);
     program->type = NODE_PROGRAM;
-    program->data.block.stmt_count = 0;
-    program->data.block.statements = malloc(sizeof(ASTNode*) * 1000);
+    int start = parse_scratch_count;
     
     while (peek(tok)->type != TOK_EOF) {
         ASTNode *stmt = parse_statement(tok);
-        if (stmt) {
-            program->data.block.statements[program->data.block.stmt_count++] = stmt;
-        }
+        if (stmt) scratch_push(stmt);
     }
     
+    program->data.block.statements = scratch_finish(start, &program->data.block.stmt_count);
     return program;
 }
 
-// ============= INTERPRETER =============
-Value create_int(int val) {
-    Value v;
-    v.type = VAL_INT;
-    v.data.int_val = val;
-    return v;
+// ============= VALUE OPERATIONS =============
+#define NUMBER_BUF_LEN 512
+
+// Text form used by print, str() and string concatenation. The result
+// is `*length` bytes and not necessarily NUL-terminated.
+const char* format_value(Value v, char *buf, size_t size, int *length) {
+    const char *text;
+    switch (v.type) {
+        case VAL_STRING:
+            *length = v.data.string_val->length;
+            return v.data.string_val->chars;
+        case VAL_INT: {
+            // Digits are written backwards from the end of the buffer
+            char *p = buf + size;
+            unsigned int n = v.data.int_val < 0 ? 0u - (unsigned int)v.data.int_val : (unsigned int)v.data.int_val;
+            do {
+                *--p = '0' + n % 10;
+                n /= 10;
+            } while (n);
+            if (v.data.int_val < 0) *--p = '-';
+            *length = (int)(buf + size - p);
+            return p;
+        }
+        case VAL_FLOAT: snprintf(buf, size, "%f", v.data.float_val); text = buf; break;
+        case VAL_BOOL: text = v.data.bool_val ? "true" : "false"; break;
+        default: text = ""; break;
+    }
+    *length = strlen(text);
+    return text;
 }
 
-Value create_float(double val) {
-    Value v;
-    v.type = VAL_FLOAT;
-    v.data.float_val = val;
-    return v;
+int is_truthy(Value v) {
+    return (v.type == VAL_BOOL && v.data.bool_val) ||
+           (v.type == VAL_INT && v.data.int_val != 0);
 }
 
-Value create_string(const char *val) {
-    Value v;
-    v.type = VAL_STRING;
-    v.data.string_val = malloc(strlen(val) + 1);
-    strcpy(v.data.string_val, val);
-    return v;
+Value int_binary(BinaryOp op, int a, int b) {
+    switch (op) {
+        case BIN_ADD: return create_int(a + b);
+        case BIN_SUB: return create_int(a - b);
+        case BIN_MUL: return create_int(a * b);
+        case BIN_DIV: return create_int(a / b);
+        case BIN_MOD: return create_int(a % b);
+        case BIN_GT:  return create_bool(a > b);
+        case BIN_LT:  return create_bool(a < b);
+        case BIN_GTE: return create_bool(a >= b);
+        case BIN_LTE: return create_bool(a <= b);
+        case BIN_EQ:  return create_bool(a == b);
+        case BIN_NEQ: return create_bool(a != b);
+        default:      return create_null();
+    }
 }
 
-Value create_bool(int val) {
-    Value v;
-    v.type = VAL_BOOL;
-    v.data.bool_val = val;
-    return v;
+Value float_binary(BinaryOp op, double a, double b) {
+    switch (op) {
+        case BIN_ADD: return create_float(a + b);
+        case BIN_SUB: return create_float(a - b);
+        case BIN_MUL: return create_float(a * b);
+        case BIN_DIV: return create_float(a / b);
+        case BIN_MOD: return create_float(fmod(a, b));
+        case BIN_GT:  return create_bool(a > b);
+        case BIN_LT:  return create_bool(a < b);
+        case BIN_GTE: return create_bool(a >= b);
+        case BIN_LTE: return create_bool(a <= b);
+        case BIN_EQ:  return create_bool(a == b);
+        case BIN_NEQ: return create_bool(a != b);
+        default:      return create_null();
+    }
 }
 
-Value create_null() {
-    Value v;
-    v.type = VAL_NULL;
-    return v;
+// l + r, where `left` is the string object behind l if there is one. If
+// l is the newest string in its buffer and r fits, r is appended in place;
+// otherwise both are copied into a new buffer with room to double. A loop
+// that keeps appending to the same string is amortized O(1) per byte.
+Value concat(ObjString *left, const char *l, int ll, const char *r, int rl) {
+    ObjBuffer *buf = left ? left->buf : NULL;
+    if (!buf || buf->length != ll || ll + rl > buf->capacity) {
+        int capacity = (ll + rl) * 2 > 16 ? (ll + rl) * 2 : 16;
+        buf = (ObjBuffer*)gc_alloc(sizeof(ObjBuffer) + capacity + 1, OBJ_BUFFER);
+        buf->capacity = capacity;
+        memcpy(buf->data, l, ll);
+        buf->length = ll;
+    }
+    memcpy(buf->data + buf->length, r, rl);
+    buf->length += rl;
+    buf->data[buf->length] = '\0';
+    
+    ObjString *str = (ObjString*)gc_alloc(sizeof(ObjString), OBJ_STRING);
+    str->length = buf->length;
+    str->chars = buf->data;
+    str->buf = buf;
+    return string_value(str);
+}
+
+Value concat_strings(ObjString *a, ObjString *b) {
+    return concat(a, a->chars, a->length, b->chars, b->length);
+}
+
+int compare_strings(ObjString *a, ObjString *b) {
+    int n = a->length < b->length ? a->length : b->length;
+    int c = memcmp(a->chars, b->chars, n);
+    return c ? c : a->length - b->length;
+}
+
+// Generic operator semantics shared by both engines: ints and bools are
+// integers, a float operand promotes the operation to float, `+` with a
+// string operand concatenates, and strings compare by content.
+Value binary_op(BinaryOp op, Value left, Value right) {
+    if (op == BIN_AND) return create_bool(is_truthy(left) && is_truthy(right));
+    if (op == BIN_OR) return create_bool(is_truthy(left) || is_truthy(right));
+    
+    if (left.type == VAL_STRING || right.type == VAL_STRING) {
+        if (op == BIN_ADD) {
+            char lbuf[NUMBER_BUF_LEN], rbuf[NUMBER_BUF_LEN];
+            int ll, rl;
+            const char *l = format_value(left, lbuf, sizeof(lbuf), &ll);
+            const char *r = format_value(right, rbuf, sizeof(rbuf), &rl);
+            return concat(left.type == VAL_STRING ? left.data.string_val : NULL, l, ll, r, rl);
+        }
+        if (left.type == VAL_STRING && right.type == VAL_STRING && op >= BIN_GT) {
+            return int_binary(op, compare_strings(left.data.string_val, right.data.string_val), 0);
+        }
+    } else if ((left.type == VAL_INT || left.type == VAL_BOOL) &&
+               (right.type == VAL_INT || right.type == VAL_BOOL)) {
+        return int_binary(op, left.data.int_val, right.data.int_val);
+    } else if ((left.type == VAL_INT || left.type == VAL_BOOL || left.type == VAL_FLOAT) &&
+               (right.type == VAL_INT || right.type == VAL_BOOL || right.type == VAL_FLOAT)) {
+        double l = left.type == VAL_FLOAT ? left.data.float_val : left.data.int_val;
+        double r = right.type == VAL_FLOAT ? right.data.float_val : right.data.int_val;
+        return float_binary(op, l, r);
+    }
+    
+    // Mismatched or non-numeric operands only support (in)equality
+    if (op == BIN_EQ || op == BIN_NEQ) {
+        int same = left.type == right.type &&
+                   (left.type == VAL_NULL || left.data.array_val == right.data.array_val);
+        return create_bool(op == BIN_EQ ? same : !same);
+    }
+    return create_null();
+}
+
+Value index_value(Value arr, Value idx) {
+    if (arr.type == VAL_ARRAY && idx.type == VAL_INT &&
+        idx.data.int_val >= 0 && idx.data.int_val < arr.data.array_val->count) {
+        return array_get(arr.data.array_val, idx.data.int_val);
+    }
+    if (arr.type == VAL_ITERATOR && arr.data.iter_val->kind == ITER_RANGE && idx.type == VAL_INT &&
+        idx.data.int_val >= 0 && idx.data.int_val < arr.data.iter_val->count) {
+        return create_int((int)(arr.data.iter_val->start + (long long)idx.data.int_val * arr.data.iter_val->step));
+    }
+    return create_null();
+}
+
+// ============= NUMERIC KERNELS =============
+// Loops behind the array builtins, over packed int and float storage.
+// Int arithmetic wraps like the interpreter's. With GCC or Clang the
+// vector bodies below are compiled once per x86 instruction set and the
+// best one the CPU supports is picked at startup; other compilers and
+// targets use the scalar loops.
+
+typedef struct {
+    int (*sum_int)(const int *a, int n);
+    double (*sum_float)(const double *a, int n);
+    int (*min_int)(const int *a, int n);         // n > 0
+    int (*max_int)(const int *a, int n);
+    double (*min_float)(const double *a, int n);
+    double (*max_float)(const double *a, int n);
+    int (*dot_int)(const int *a, const int *b, int n);
+    double (*dot_float)(const double *a, const double *b, int n);
+    void (*add_int)(const int *a, const int *b, int *out, int n);
+    void (*add_float)(const double *a, const double *b, double *out, int n);
+    void (*mul_int)(const int *a, const int *b, int *out, int n);
+    void (*mul_float)(const double *a, const double *b, double *out, int n);
+    void (*scale_int)(const int *a, int k, int *out, int n);
+    void (*scale_float)(const double *a, double k, double *out, int n);
+    const char *name;
+} NumericKernels;
+
+int sum_int_scalar(const int *a, int n) {
+    unsigned total = 0;
+    for (int i = 0; i < n; i++) total += (unsigned)a[i];
+    return (int)total;
+}
+
+double sum_float_scalar(const double *a, int n) {
+    double total = 0;
+    for (int i = 0; i < n; i++) total += a[i];
+    return total;
+}
+
+int min_int_scalar(const int *a, int n) {
+    int m = a[0];
+    for (int i = 1; i < n; i++) if (a[i] < m) m = a[i];
+    return m;
+}
+
+int max_int_scalar(const int *a, int n) {
+    int m = a[0];
+    for (int i = 1; i < n; i++) if (a[i] > m) m = a[i];
+    return m;
+}
+
+double min_float_scalar(const double *a, int n) {
+    double m = a[0];
+    for (int i = 1; i < n; i++) if (a[i] < m) m = a[i];
+    return m;
+}
+
+double max_float_scalar(const double *a, int n) {
+    double m = a[0];
+    for (int i = 1; i < n; i++) if (a[i] > m) m = a[i];
+    return m;
+}
+
+int dot_int_scalar(const int *a, const int *b, int n) {
+    unsigned total = 0;
+    for (int i = 0; i < n; i++) total += (unsigned)a[i] * (unsigned)b[i];
+    return (int)total;
+}
+
+double dot_float_scalar(const double *a, const double *b, int n) {
+    double total = 0;
+    for (int i = 0; i < n; i++) total += a[i] * b[i];
+    return total;
+}
+
+void add_int_scalar(const int *a, const int *b, int *out, int n) {
+    for (int i = 0; i < n; i++) out[i] = (int)((unsigned)a[i] + (unsigned)b[i]);
+}
+
+void add_float_scalar(const double *a, const double *b, double *out, int n) {
+    for (int i = 0; i < n; i++) out[i] = a[i] + b[i];
+}
+
+void mul_int_scalar(const int *a, const int *b, int *out, int n) {
+    for (int i = 0; i < n; i++) out[i] = (int)((unsigned)a[i] * (unsigned)b[i]);
+}
+
+void mul_float_scalar(const double *a, const double *b, double *out, int n) {
+    for (int i = 0; i < n; i++) out[i] = a[i] * b[i];
+}
+
+void scale_int_scalar(const int *a, int k, int *out, int n) {
+    for (int i = 0; i < n; i++) out[i] = (int)((unsigned)a[i] * (unsigned)k);
+}
+
+void scale_float_scalar(const double *a, double k, double *out, int n) {
+    for (int i = 0; i < n; i++) out[i] = a[i] * k;
+}
+
+NumericKernels scalar_kernels = {
+    sum_int_scalar, sum_float_scalar,
+    min_int_scalar, max_int_scalar, min_float_scalar, max_float_scalar,
+    dot_int_scalar, dot_float_scalar,
+    add_int_scalar, add_float_scalar, mul_int_scalar, mul_float_scalar,
+    scale_int_scalar, scale_float_scalar,
+    "scalar"
+};
+
+NumericKernels *kernels = &scalar_kernels;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VECTOR_KERNELS 1
+
+// One set of vector types per instruction set, 256-bit for AVX2 and
+// 128-bit for SSE4.1. The `_u` types allow unaligned loads and stores.
+#define DEFINE_VECTOR_TYPES(isa, bytes) \
+typedef int vint_##isa __attribute__((vector_size(bytes))); \
+typedef unsigned vuint_##isa __attribute__((vector_size(bytes))); \
+typedef long long vlong_##isa __attribute__((vector_size(bytes))); \
+typedef double vdouble_##isa __attribute__((vector_size(bytes))); \
+typedef int vint_u_##isa __attribute__((vector_size(bytes), aligned(4), may_alias)); \
+typedef unsigned vuint_u_##isa __attribute__((vector_size(bytes), aligned(4), may_alias)); \
+typedef double vdouble_u_##isa __attribute__((vector_size(bytes), aligned(8), may_alias));
+
+// Lane-wise select: where mask is set take a, else b.
+#define VSELECT(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+
+#define DEFINE_VECTOR_KERNELS(isa, target) \
+enum { VINTS_##isa = sizeof(vint_##isa) / sizeof(int), VDOUBLES_##isa = sizeof(vdouble_##isa) / sizeof(double) }; \
+target int sum_int_##isa(const int *a, int n) { \
+    vuint_##isa acc = {0}; \
+    int i = 0; \
+    for (; i + VINTS_##isa <= n; i += VINTS_##isa) acc += *(const vuint_u_##isa*)(a + i); \
+    unsigned total = 0; \
+    for (int j = 0; j < VINTS_##isa; j++) total += acc[j]; \
+    for (; i < n; i++) total += (unsigned)a[i]; \
+    return (int)total; \
+} \
+target double sum_float_##isa(const double *a, int n) { \
+    vdouble_##isa acc0 = {0}, acc1 = {0}; \
+    int i = 0; \
+    for (; i + 2 * VDOUBLES_##isa <= n; i += 2 * VDOUBLES_##isa) { \
+        acc0 += *(const vdouble_u_##isa*)(a + i); \
+        acc1 += *(const vdouble_u_##isa*)(a + i + VDOUBLES_##isa); \
+    } \
+    acc0 += acc1; \
+    double total = 0; \
+    for (int j = 0; j < VDOUBLES_##isa; j++) total += acc0[j]; \
+    for (; i < n; i++) total += a[i]; \
+    return total; \
+} \
+target int min_int_##isa(const int *a, int n) { \
+    if (n < VINTS_##isa) return min_int_scalar(a, n); \
+    vint_##isa m = *(const vint_u_##isa*)a; \
+    int i = VINTS_##isa; \
+    for (; i + VINTS_##isa <= n; i += VINTS_##isa) { \
+        vint_##isa v = *(const vint_u_##isa*)(a + i); \
+        m = VSELECT(v < m, v, m); \
+    } \
+    int result = m[0]; \
+    for (int j = 1; j < VINTS_##isa; j++) if (m[j] < result) result = m[j]; \
+    for (; i < n; i++) if (a[i] < result) result = a[i]; \
+    return result; \
+} \
+target int max_int_##isa(const int *a, int n) { \
+    if (n < VINTS_##isa) return max_int_scalar(a, n); \
+    vint_##isa m = *(const vint_u_##isa*)a; \
+    int i = VINTS_##isa; \
+    for (; i + VINTS_##isa <= n; i += VINTS_##isa) { \
+        vint_##isa v = *(const vint_u_##isa*)(a + i); \
+        m = VSELECT(v > m, v, m); \
+    } \
+    int result = m[0]; \
+    for (int j = 1; j < VINTS_##isa; j++) if (m[j] > result) result = m[j]; \
+    for (; i < n; i++) if (a[i] > result) result = a[i]; \
+    return result; \
+} \
+target double min_float_##isa(const double *a, int n) { \
+    if (n < VDOUBLES_##isa) return min_float_scalar(a, n); \
+    vdouble_##isa m = *(const vdouble_u_##isa*)a; \
+    int i = VDOUBLES_##isa; \
+    for (; i + VDOUBLES_##isa <= n; i += VDOUBLES_##isa) { \
+        vdouble_##isa v = *(const vdouble_u_##isa*)(a + i); \
+        m = (vdouble_##isa)VSELECT(v < m, (vlong_##isa)v, (vlong_##isa)m); \
+    } \
+    double result = m[0]; \
+    for (int j = 1; j < VDOUBLES_##isa; j++) if (m[j] < result) result = m[j]; \
+    for (; i < n; i++) if (a[i] < result) result = a[i]; \
+    return result; \
+} \
+target double max_float_##isa(const double *a, int n) { \
+    if (n < VDOUBLES_##isa) return max_float_scalar(a, n); \
+    vdouble_##isa m = *(const vdouble_u_##isa*)a; \
+    int i = VDOUBLES_##isa; \
+    for (; i + VDOUBLES_##isa <= n; i += VDOUBLES_##isa) { \
+        vdouble_##isa v = *(const vdouble_u_##isa*)(a + i); \
+        m = (vdouble_##isa)VSELECT(v > m, (vlong_##isa)v, (vlong_##isa)m); \
+    } \
+    double result = m[0]; \
+    for (int j = 1; j < VDOUBLES_##isa; j++) if (m[j] > result) result = m[j]; \
+    for (; i < n; i++) if (a[i] > result) result = a[i]; \
+    return result; \
+} \
+target int dot_int_##isa(const int *a, const int *b, int n) { \
+    vuint_##isa acc = {0}; \
+    int i = 0; \
+    for (; i + VINTS_##isa <= n; i += VINTS_##isa) acc += *(const vuint_u_##isa*)(a + i) * *(const vuint_u_##isa*)(b + i); \
+    unsigned total = 0; \
+    for (int j = 0; j < VINTS_##isa; j++) total += acc[j]; \
+    for (; i < n; i++) total += (unsigned)a[i] * (unsigned)b[i]; \
+    return (int)total; \
+} \
+target double dot_float_##isa(const double *a, const double *b, int n) { \
+    vdouble_##isa acc = {0}; \
+    int i = 0; \
+    for (; i + VDOUBLES_##isa <= n; i += VDOUBLES_##isa) acc += *(const vdouble_u_##isa*)(a + i) * *(const vdouble_u_##isa*)(b + i); \
+    double total = 0; \
+    for (int j = 0; j < VDOUBLES_##isa; j++) total += acc[j]; \
+    for (; i < n; i++) total += a[i] * b[i]; \
+    return total; \
+} \
+target void add_int_##isa(const int *a, const int *b, int *out, int n) { \
+    int i = 0; \
+    for (; i + VINTS_##isa <= n; i += VINTS_##isa) \
+        *(vuint_u_##isa*)(out + i) = *(const vuint_u_##isa*)(a + i) + *(const vuint_u_##isa*)(b + i); \
+    add_int_scalar(a + i, b + i, out + i, n - i); \
+} \
+target void add_float_##isa(const double *a, const double *b, double *out, int n) { \
+    int i = 0; \
+    for (; i + VDOUBLES_##isa <= n; i += VDOUBLES_##isa) \
+        *(vdouble_u_##isa*)(out + i) = *(const vdouble_u_##isa*)(a + i) + *(const vdouble_u_##isa*)(b + i); \
+    add_float_scalar(a + i, b + i, out + i, n - i); \
+} \
+target void mul_int_##isa(const int *a, const int *b, int *out, int n) { \
+    int i = 0; \
+    for (; i + VINTS_##isa <= n; i += VINTS_##isa) \
+        *(vuint_u_##isa*)(out + i) = *(const vuint_u_##isa*)(a + i) * *(const vuint_u_##isa*)(b + i); \
+    mul_int_scalar(a + i, b + i, out + i, n - i); \
+} \
+target void mul_float_##isa(const double *a, const double *b, double *out, int n) { \
+    int i = 0; \
+    for (; i + VDOUBLES_##isa <= n; i += VDOUBLES_##isa) \
+        *(vdouble_u_##isa*)(out + i) = *(const vdouble_u_##isa*)(a + i) * *(const vdouble_u_##isa*)(b + i); \
+    mul_float_scalar(a + i, b + i, out + i, n - i); \
+} \
+target void scale_int_##isa(const int *a, int k, int *out, int n) { \
+    int i = 0; \
+    for (; i + VINTS_##isa <= n; i += VINTS_##isa) \
+        *(vuint_u_##isa*)(out + i) = *(const vuint_u_##isa*)(a + i) * (unsigned)k; \
+    scale_int_scalar(a + i, k, out + i, n - i); \
+} \
+target void scale_float_##isa(const double *a, double k, double *out, int n) { \
+    int i = 0; \
+    for (; i + VDOUBLES_##isa <= n; i += VDOUBLES_##isa) \
+        *(vdouble_u_##isa*)(out + i) = *(const vdouble_u_##isa*)(a + i) * k; \
+    scale_float_scalar(a + i, k, out + i, n - i); \
+} \
+NumericKernels isa##_kernels = { \
+    sum_int_##isa, sum_float_##isa, \
+    min_int_##isa, max_int_##isa, min_float_##isa, max_float_##isa, \
+    dot_int_##isa, dot_float_##isa, \
+    add_int_##isa, add_float_##isa, mul_int_##isa, mul_float_##isa, \
+    scale_int_##isa, scale_float_##isa, \
+    #isa \
+};
+
+DEFINE_VECTOR_TYPES(avx2, 32)
+DEFINE_VECTOR_KERNELS(avx2, __attribute__((target("avx2"))))
+DEFINE_VECTOR_TYPES(sse41, 16)
+DEFINE_VECTOR_KERNELS(sse41, __attribute__((target("sse4.1"))))
+#endif
+
+void init_kernels() {
+#ifdef VECTOR_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) kernels = &avx2_kernels;
+    else if (__builtin_cpu_supports("sse4.1")) kernels = &sse41_kernels;
+#endif
+}
+
+// ============= OUTPUT =============
+// print and write append to one buffer that goes to fd 1 in large
+// writes. It is flushed before input() reads, when the program exits
+// (also through an error), and after each line in line-buffered mode,
+// which is the default when stdout is a terminal.
+#define DEFAULT_OUTPUT_BUFFER (64 * 1024)
+
+char *output_buffer = NULL;
+size_t output_capacity = DEFAULT_OUTPUT_BUFFER;
+size_t output_length = 0;
+int output_line_buffered = 0;
+
+void write_all(const char *data, size_t length) {
+#ifndef _WIN32
+    while (length > 0) {
+        ssize_t n = write(1, data, length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;  // nowhere left to report it
+        }
+        data += n;
+        length -= n;
+    }
+#else
+    fwrite(data, 1, length, stdout);
+    fflush(stdout);
+#endif
+}
+
+void flush_output() {
+    write_all(output_buffer, output_length);
+    output_length = 0;
+}
+
+void output_bytes(const char *data, size_t length) {
+    if (output_length + length > output_capacity) {
+        flush_output();
+        if (length >= output_capacity) {
+            write_all(data, length);
+            return;
+        }
+    }
+    memcpy(output_buffer + output_length, data, length);
+    output_length += length;
+}
+
+void output_value(Value v) {
+    char buf[NUMBER_BUF_LEN];
+    int length;
+    const char *text = format_value(v, buf, sizeof(buf), &length);
+    output_bytes(text, length);
+}
+
+void init_output() {
+    output_buffer = malloc(output_capacity);
+    if (!output_buffer) {
+        fprintf(stderr, "Error: Cannot allocate a %zu byte output buffer\n", output_capacity);
+        exit(1);
+    }
+#ifndef _WIN32
+    if (isatty(1)) output_line_buffered = 1;
+#endif
+    atexit(flush_output);
+}
+
+// ============= INPUT =============
+// input(), read_all(), read_lines() and lines() share one buffer over fd
+// 0, so they can be mixed freely. It is refilled in large chunks and only
+// grows to hold the longest line; lines are found with memchr.
+#define INPUT_CHUNK (64 * 1024)
+
+char *input_buffer = NULL;
+size_t input_start = 0;      // first unread byte
+size_t input_end = 0;        // end of the bytes read so far
+size_t input_capacity = 0;
+int input_eof = 0;
+
+// Reads another chunk after the unread bytes, moving them to the front of
+// the buffer first. Returns 0 at the end of input.
+int fill_input() {
+    if (input_eof) return 0;
+    if (input_start > 0) {
+        memmove(input_buffer, input_buffer + input_start, input_end - input_start);
+        input_end -= input_start;
+        input_start = 0;
+    }
+    if (input_capacity - input_end < INPUT_CHUNK / 2) {
+        size_t grown = input_capacity ? input_capacity * 2 : INPUT_CHUNK;
+        char *moved = realloc(input_buffer, grown);
+        if (!moved) {
+            flush_output();
+            fprintf(stderr, "Error: Out of memory reading input\n");
+            exit(1);
+        }
+        input_buffer = moved;
+        input_capacity = grown;
+    }
+#ifndef _WIN32
+    ssize_t n;
+    do {
+        n = read(0, input_buffer + input_end, input_capacity - input_end);
+    } while (n < 0 && errno == EINTR);
+#else
+    long n = (long)fread(input_buffer + input_end, 1, input_capacity - input_end, stdin);
+#endif
+    if (n <= 0) {
+        input_eof = 1;
+        return 0;
+    }
+    input_end += n;
+    return 1;
+}
+
+Value take_input(size_t length, size_t consumed) {
+    if (length > INT_MAX) {
+        flush_output();
+        fprintf(stderr, "Error: Input line longer than %d bytes\n", INT_MAX);
+        exit(1);
+    }
+    Value line = create_string_span(input_buffer + input_start, (int)length);
+    input_start += consumed;
+    return line;
+}
+
+// The next line of stdin without its newline. Returns 0 at the end of
+// input; a last line with no newline still counts.
+int read_line(Value *out) {
+    size_t scanned = 0;  // bytes after input_start known to hold no newline
+    for (;;) {
+        size_t unscanned = input_end - input_start - scanned;
+        char *newline = unscanned ? memchr(input_buffer + input_start + scanned, '\n', unscanned) : NULL;
+        if (newline) {
+            size_t length = newline - (input_buffer + input_start);
+            *out = take_input(length, length + 1);
+            return 1;
+        }
+        scanned = input_end - input_start;
+        if (!fill_input()) break;
+    }
+    if (input_start == input_end) return 0;
+    *out = take_input(input_end - input_start, input_end - input_start);
+    return 1;
+}
+
+// ============= BUILTINS =============
+// Each builtin is a native function in the table below. The resolver
+// finds it through the symbol interner (init_builtins tags every name)
+// and checks arity there, so call sites carry a direct Builtin pointer
+// and the natives can trust argc.
+typedef Value (*NativeFn)(Value *args, int argc);
+
+typedef struct Builtin {
+    const char *name;
+    NativeFn fn;
+    int min_args;
+    int max_args;   // -1 for variadic
+    int pure;       // no side effects, so callers may be memoized
+} Builtin;
+
+int number_value(Value v, double *out) {
+    if (v.type == VAL_INT) *out = v.data.int_val;
+    else if (v.type == VAL_FLOAT) *out = v.data.float_val;
+    else return 0;
+    return 1;
+}
+
+// sum (BIN_ADD), min (BIN_LT) and max (BIN_GT). Packed arrays use the
+// numeric kernels; generic ones fold with the language's own + and
+// comparisons.
+Value array_reduce(BinaryOp op, ObjArray *arr) {
+    int n = arr->count;
+    if (n == 0) return op == BIN_ADD ? create_int(0) : create_null();
+    switch (arr->kind) {
+        case ARRAY_INT:
+            if (op == BIN_ADD) return create_int(kernels->sum_int(arr->data.ints, n));
+            if (op == BIN_LT) return create_int(kernels->min_int(arr->data.ints, n));
+            return create_int(kernels->max_int(arr->data.ints, n));
+        case ARRAY_FLOAT:
+            if (op == BIN_ADD) return create_float(kernels->sum_float(arr->data.floats, n));
+            if (op == BIN_LT) return create_float(kernels->min_float(arr->data.floats, n));
+            return create_float(kernels->max_float(arr->data.floats, n));
+        default: {
+            Value result = arr->data.values[0];
+            for (int i = 1; i < n; i++) {
+                Value v = arr->data.values[i];
+                if (op == BIN_ADD) result = binary_op(BIN_ADD, result, v);
+                else if (is_truthy(binary_op(op, v, result))) result = v;
+            }
+            return result;
+        }
+    }
+}
+
+Value array_mean(ObjArray *arr) {
+    int n = arr->count;
+    if (n == 0) return create_null();
+    if (arr->kind == ARRAY_FLOAT) return create_float(kernels->sum_float(arr->data.floats, n) / n);
+    // Ints are summed wide so the mean does not wrap
+    double total = 0;
+    if (arr->kind == ARRAY_INT) {
+        long long wide = 0;
+        for (int i = 0; i < n; i++) wide += arr->data.ints[i];
+        total = (double)wide;
+    } else {
+        for (int i = 0; i < n; i++) {
+            double x;
+            if (!number_value(arr->data.values[i], &x)) return create_null();
+            total += x;
+        }
+    }
+    return create_float(total / n);
+}
+
+Value array_dot(ObjArray *a, ObjArray *b) {
+    int n = a->count < b->count ? a->count : b->count;
+    if (a->kind == ARRAY_INT && b->kind == ARRAY_INT) {
+        return create_int(kernels->dot_int(a->data.ints, b->data.ints, n));
+    }
+    if (a->kind == ARRAY_FLOAT && b->kind == ARRAY_FLOAT) {
+        return create_float(kernels->dot_float(a->data.floats, b->data.floats, n));
+    }
+    double total = 0;
+    for (int i = 0; i < n; i++) {
+        double x, y;
+        if (!number_value(array_get(a, i), &x) || !number_value(array_get(b, i), &y)) return create_null();
+        total += x * y;
+    }
+    return create_float(total);
+}
+
+// Element-wise a + b or a * b, over the shorter length. Mixed or generic
+// arrays apply the language's operator to each pair.
+Value array_elementwise(BinaryOp op, ObjArray *a, ObjArray *b) {
+    int n = a->count < b->count ? a->count : b->count;
+    if (a->kind == b->kind && a->kind != ARRAY_VALUE) {
+        Value result = create_array(a->kind, n);
+        ObjArray *out = result.data.array_val;
+        if (a->kind == ARRAY_INT) {
+            (op == BIN_ADD ? kernels->add_int : kernels->mul_int)(a->data.ints, b->data.ints, out->data.ints, n);
+        } else {
+            (op == BIN_ADD ? kernels->add_float : kernels->mul_float)(a->data.floats, b->data.floats, out->data.floats, n);
+        }
+        return result;
+    }
+    Value *items = malloc(sizeof(Value) * (n > 0 ? n : 1));
+    for (int i = 0; i < n; i++) items[i] = binary_op(op, array_get(a, i), array_get(b, i));
+    Value result = create_array_from(items, n);
+    free(items);
+    return result;
+}
+
+Value array_scale(ObjArray *a, Value k) {
+    int n = a->count;
+    double factor;
+    if (a->kind == ARRAY_INT && k.type == VAL_INT) {
+        Value result = create_array(ARRAY_INT, n);
+        kernels->scale_int(a->data.ints, k.data.int_val, result.data.array_val->data.ints, n);
+        return result;
+    }
+    if (a->kind == ARRAY_FLOAT && number_value(k, &factor)) {
+        Value result = create_array(ARRAY_FLOAT, n);
+        kernels->scale_float(a->data.floats, factor, result.data.array_val->data.floats, n);
+        return result;
+    }
+    Value *items = malloc(sizeof(Value) * (n > 0 ? n : 1));
+    for (int i = 0; i < n; i++) items[i] = binary_op(BIN_MUL, array_get(a, i), k);
+    Value result = create_array_from(items, n);
+    free(items);
+    return result;
+}
+
+// Arguments are evaluated by the caller, left to right.
+Value builtin_input(Value *args, int argc) {
+    // Optional prompt: input("Enter: ")
+    if (argc >= 1 && args[0].type == VAL_STRING) {
+        output_bytes(args[0].data.string_val->chars, args[0].data.string_val->length);
+    }
+    flush_output();
+
+    Value line;
+    if (!read_line(&line)) return create_string("");
+    return line;
+}
+
+// The rest of stdin as one string.
+Value builtin_read_all(Value *args, int argc) {
+    flush_output();
+    while (fill_input());
+    return take_input(input_end - input_start, input_end - input_start);
+}
+
+// The remaining lines of stdin as an array of strings.
+Value builtin_read_lines(Value *args, int argc) {
+    flush_output();
+    int count = 0, capacity = 64;
+    Value *items = malloc(sizeof(Value) * capacity);
+    Value line;
+    while (read_line(&line)) {
+        if (count == capacity) {
+            capacity *= 2;
+            items = realloc(items, sizeof(Value) * capacity);
+        }
+        items[count++] = line;
+    }
+    Value result = create_array_from(items, count);
+    free(items);
+    return result;
+}
+
+// for (line in lines()) streams stdin one line at a time.
+Value builtin_lines(Value *args, int argc) {
+    flush_output();
+    return create_iterator(ITER_LINES);
+}
+
+Value builtin_print(Value *args, int argc) {
+    for (int i = 0; i < argc; i++) output_value(args[i]);
+    output_bytes("\n", 1);
+    if (output_line_buffered) flush_output();
+    return create_null();
+}
+
+// print without the newline
+Value builtin_write(Value *args, int argc) {
+    int newline = 0;
+    for (int i = 0; i < argc; i++) {
+        output_value(args[i]);
+        newline |= args[i].type == VAL_STRING && memchr(args[i].data.string_val->chars, '\n', args[i].data.string_val->length);
+    }
+    if (output_line_buffered && newline) flush_output();
+    return create_null();
+}
+
+Value builtin_flush(Value *args, int argc) {
+    flush_output();
+    return create_null();
+}
+
+Value builtin_str(Value *args, int argc) {
+    if (args[0].type == VAL_STRING) return args[0];
+    char buf[NUMBER_BUF_LEN];
+    int length;
+    const char *text = format_value(args[0], buf, sizeof(buf), &length);
+    return create_string_span(text, length);
+}
+
+Value builtin_int(Value *args, int argc) {
+    Value arg = args[0];
+    if (arg.type == VAL_STRING) {
+        // Only the leading digits matter
+        char text[32];
+        int n = arg.data.string_val->length < 31 ? arg.data.string_val->length : 31;
+        memcpy(text, arg.data.string_val->chars, n);
+        text[n] = '\0';
+        return create_int(atoi(text));
+    }
+    if (arg.type == VAL_FLOAT) return create_int((int)arg.data.float_val);
+    return arg;
+}
+
+Value builtin_len(Value *args, int argc) {
+    if (args[0].type == VAL_ARRAY) return create_int(args[0].data.array_val->count);
+    if (args[0].type == VAL_ITERATOR && args[0].data.iter_val->kind == ITER_RANGE) {
+        return create_int(args[0].data.iter_val->count);
+    }
+    if (args[0].type == VAL_STRING) return create_int(args[0].data.string_val->length);
+    return create_int(0);
+}
+
+Value builtin_sum(Value *args, int argc) {
+    if (args[0].type != VAL_ARRAY) return create_null();
+    return array_reduce(BIN_ADD, args[0].data.array_val);
+}
+
+Value builtin_min(Value *args, int argc) {
+    if (args[0].type != VAL_ARRAY) return create_null();
+    return array_reduce(BIN_LT, args[0].data.array_val);
+}
+
+Value builtin_max(Value *args, int argc) {
+    if (args[0].type != VAL_ARRAY) return create_null();
+    return array_reduce(BIN_GT, args[0].data.array_val);
+}
+
+Value builtin_mean(Value *args, int argc) {
+    if (args[0].type != VAL_ARRAY) return create_null();
+    return array_mean(args[0].data.array_val);
+}
+
+Value builtin_dot(Value *args, int argc) {
+    if (args[0].type != VAL_ARRAY || args[1].type != VAL_ARRAY) return create_null();
+    return array_dot(args[0].data.array_val, args[1].data.array_val);
+}
+
+Value builtin_add(Value *args, int argc) {
+    if (args[0].type != VAL_ARRAY || args[1].type != VAL_ARRAY) return create_null();
+    return array_elementwise(BIN_ADD, args[0].data.array_val, args[1].data.array_val);
+}
+
+Value builtin_mul(Value *args, int argc) {
+    if (args[0].type != VAL_ARRAY || args[1].type != VAL_ARRAY) return create_null();
+    return array_elementwise(BIN_MUL, args[0].data.array_val, args[1].data.array_val);
+}
+
+Value builtin_scale(Value *args, int argc) {
+    if (args[0].type != VAL_ARRAY) return create_null();
+    return array_scale(args[0].data.array_val, args[1]);
+}
+
+// range(stop), range(start, stop) or range(start, stop, step)
+Value builtin_range(Value *args, int argc) {
+    int bounds[3] = { 0, 0, 1 };
+    for (int i = 0; i < argc; i++) {
+        if (args[i].type != VAL_INT) return create_null();
+        bounds[argc == 1 ? 1 : i] = args[i].data.int_val;
+    }
+    if (bounds[2] == 0) {
+        flush_output();
+        fprintf(stderr, "Error: range() step must not be zero\n");
+        exit(1);
+    }
+    return create_range(bounds[0], bounds[1], bounds[2]);
+}
+
+Builtin builtins[] = {
+    { "input",      builtin_input,       0,  1, 0 },
+    { "print",      builtin_print,       0, -1, 0 },
+    { "write",      builtin_write,       0, -1, 0 },
+    { "flush",      builtin_flush,       0,  0, 0 },
+    { "read_all",   builtin_read_all,    0,  0, 0 },
+    { "read_lines", builtin_read_lines,  0,  0, 0 },
+    { "lines",      builtin_lines,       0,  0, 0 },
+    { "str",        builtin_str,         1,  1, 1 },
+    { "int",        builtin_int,         1,  1, 1 },
+    { "len",        builtin_len,         1,  1, 1 },
+    { "sum",        builtin_sum,         1,  1, 1 },
+    { "min",        builtin_min,         1,  1, 1 },
+    { "max",        builtin_max,         1,  1, 1 },
+    { "mean",       builtin_mean,        1,  1, 1 },
+    { "dot",        builtin_dot,         2,  2, 1 },
+    { "add",        builtin_add,         2,  2, 1 },
+    { "mul",        builtin_mul,         2,  2, 1 },
+    { "scale",      builtin_scale,       2,  2, 1 },
+    { "range",      builtin_range,       1,  3, 1 },
+};
+
+#define BUILTIN_COUNT ((int)(sizeof(builtins) / sizeof(builtins[0])))
+
+void init_builtins() {
+    for (int i = 0; i < BUILTIN_COUNT; i++) {
+        intern(builtins[i].name, strlen(builtins[i].name))->builtin = &builtins[i];
+    }
+}
+
+// ============= MEMOIZATION =============
+// Results of pure functions (`@memo`, or every pure function under
+// --auto-memo) are cached per declaration, keyed by the argument values.
+// Each cache holds at most MEMO_CAPACITY entries and evicts the least
+// recently used one. Calls with array or iterator arguments bypass it.
+
+#define MEMO_CAPACITY 65536
+
+typedef struct MemoEntry {
+    struct MemoCache *cache;
+    unsigned hash;
+    unsigned long undefined_calls;      // undefined_calls when the call began
+    Value result;
+    struct MemoEntry *chain;            // hash bucket
+    struct MemoEntry *newer, *older;    // recency list
+    Value args[];                       // param_count of them
+} MemoEntry;
+
+typedef struct MemoCache {
+    int param_count;
+    MemoEntry **buckets;
+    int bucket_count;                   // power of two
+    int count;
+    MemoEntry *newest, *oldest;
+} MemoCache;
+
+MemoCache **memo_caches = NULL;         // every cache, for the collector
+int memo_cache_count = 0;
+int memo_cache_capacity = 0;
+int auto_memo = 0;
+// Calls to functions whose declaration has not run yet. They return null
+// until it does, so a result that depended on one must not be cached.
+unsigned long undefined_calls = 0;
+
+MemoCache* create_memo_cache(int param_count) {
+    MemoCache *cache = calloc(1, sizeof(MemoCache));
+    cache->param_count = param_count;
+    cache->bucket_count = 64;
+    cache->buckets = calloc(cache->bucket_count, sizeof(MemoEntry*));
+    if (memo_cache_count == memo_cache_capacity) {
+        memo_cache_capacity = memo_cache_capacity ? memo_cache_capacity * 2 : 16;
+        memo_caches = realloc(memo_caches, sizeof(MemoCache*) * memo_cache_capacity);
+    }
+    memo_caches[memo_cache_count++] = cache;
+    return cache;
+}
+
+// Only plain values can be keys. Floats hash and compare by their bits,
+// so 0.0 and -0.0 are different keys.
+int memo_key_value(Value v) {
+    return v.type == VAL_INT || v.type == VAL_FLOAT || v.type == VAL_STRING ||
+           v.type == VAL_BOOL || v.type == VAL_NULL;
+}
+
+unsigned memo_hash_value(Value v) {
+    unsigned long long bits = 0;
+    switch (v.type) {
+        case VAL_STRING:
+            return hash_name(v.data.string_val->chars, v.data.string_val->length);
+        case VAL_FLOAT:
+            memcpy(&bits, &v.data.float_val, sizeof(double));
+            break;
+        case VAL_NULL:
+            break;
+        default:
+            bits = (unsigned)v.data.int_val;
+            break;
+    }
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (unsigned)bits ^ (unsigned)v.type;
+}
+
+int memo_key_equal(Value a, Value b) {
+    if (a.type != b.type) return 0;
+    switch (a.type) {
+        case VAL_STRING:
+            return a.data.string_val->length == b.data.string_val->length &&
+                   memcmp(a.data.string_val->chars, b.data.string_val->chars, a.data.string_val->length) == 0;
+        case VAL_FLOAT:
+            return memcmp(&a.data.float_val, &b.data.float_val, sizeof(double)) == 0;
+        case VAL_NULL:
+            return 1;
+        default:
+            return a.data.int_val == b.data.int_val;
+    }
+}
+
+void memo_unlink(MemoCache *cache, MemoEntry *entry) {
+    if (entry->newer) entry->newer->older = entry->older;
+    else cache->newest = entry->older;
+    if (entry->older) entry->older->newer = entry->newer;
+    else cache->oldest = entry->newer;
+}
+
+void memo_link_newest(MemoCache *cache, MemoEntry *entry) {
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest) cache->newest->newer = entry;
+    else cache->oldest = entry;
+    cache->newest = entry;
+}
+
+MemoEntry* memo_find(MemoCache *cache, unsigned hash, Value *args, int argc) {
+    for (MemoEntry *entry = cache->buckets[hash & (cache->bucket_count - 1)]; entry; entry = entry->chain) {
+        if (entry->hash != hash) continue;
+        int i = 0;
+        while (i < cache->param_count && memo_key_equal(entry->args[i], i < argc ? args[i] : create_null())) i++;
+        if (i == cache->param_count) return entry;
+    }
+    return NULL;
+}
+
+// Looks up a call. On a hit the cached result is stored in *result and 1
+// is returned. On a miss *pending receives an entry holding a copy of the
+// key (the callee may overwrite its parameters), to be completed by
+// memo_store when the call returns; it is NULL if the call cannot be
+// cached, and no entry is made if `pending` is NULL. Missing arguments
+// are null and extra ones are ignored, as in the call itself.
+int memo_lookup(MemoCache *cache, Value *args, int argc, Value *result, MemoEntry **pending) {
+    int n = cache->param_count;
+    unsigned hash = 2166136261u;
+    if (pending) *pending = NULL;
+    for (int i = 0; i < n; i++) {
+        Value arg = i < argc ? args[i] : create_null();
+        if (!memo_key_value(arg)) return 0;
+        hash = (hash ^ memo_hash_value(arg)) * 16777619u;
+    }
+    MemoEntry *entry = memo_find(cache, hash, args, argc);
+    if (entry) {
+        memo_unlink(cache, entry);
+        memo_link_newest(cache, entry);
+        *result = entry->result;
+        return 1;
+    }
+    if (!pending) return 0;
+    entry = malloc(sizeof(MemoEntry) + sizeof(Value) * n);
+    entry->cache = cache;
+    entry->hash = hash;
+    entry->undefined_calls = undefined_calls;
+    entry->result = create_null();
+    for (int i = 0; i < n; i++) entry->args[i] = i < argc ? args[i] : create_null();
+    *pending = entry;
+    return 0;
+}
+
+void memo_grow(MemoCache *cache) {
+    int capacity = cache->bucket_count * 2;
+    MemoEntry **buckets = calloc(capacity, sizeof(MemoEntry*));
+    for (MemoEntry *entry = cache->newest; entry; entry = entry->older) {
+        entry->chain = buckets[entry->hash & (capacity - 1)];
+        buckets[entry->hash & (capacity - 1)] = entry;
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->bucket_count = capacity;
+}
+
+// Completes a pending entry and adds it to its cache, evicting the least
+// recently used entry if the cache is full. The entry is dropped if the
+// call reached an undefined function.
+void memo_store(MemoEntry *entry, Value result) {
+    MemoCache *cache = entry->cache;
+    entry->result = result;
+    // A recursive call with the same key may have finished first
+    if (entry->undefined_calls != undefined_calls ||
+        memo_find(cache, entry->hash, entry->args, cache->param_count)) {
+        free(entry);
+        return;
+    }
+    if (cache->count == MEMO_CAPACITY) {
+        MemoEntry *victim = cache->oldest;
+        MemoEntry **link = &cache->buckets[victim->hash & (cache->bucket_count - 1)];
+        while (*link != victim) link = &(*link)->chain;
+        *link = victim->chain;
+        memo_unlink(cache, victim);
+        free(victim);
+        cache->count--;
+    } else if (cache->count == cache->bucket_count) {
+        memo_grow(cache);
+    }
+    MemoEntry **bucket = &cache->buckets[entry->hash & (cache->bucket_count - 1)];
+    entry->chain = *bucket;
+    *bucket = entry;
+    memo_link_newest(cache, entry);
+    cache->count++;
+}
+
+// ============= RESOLVER =============
+// Runs between parse_program and eval. Every variable reference is bound
+// to a (depth, slot) pair and every call to a function table index, so
+// the interpreter never looks names up at runtime. Depth 0 is the current
+// frame, depth 1 the global frame.
+
+typedef struct {
+    Symbol *name;
+    int slot;
+    int is_const;
+    int scope;       // block nesting level the name was declared at
+} ScopeName;
+
+typedef struct {
+    ScopeName *names;
+    int count;
+    int capacity;
+    int scope;       // current block nesting level
+    int slot_count;  // frame size so far
+    int loop_depth;  // enclosing loops, for break/continue checks
+} FrameScope;
+
+FrameScope global_scope;
+FrameScope *current_scope = &global_scope;
+Symbol **func_names = NULL;
+int func_name_capacity = 0;
+ASTNode **func_decls = NULL;    // every declaration, for the purity analysis
+int func_decl_count = 0;
+int func_decl_capacity = 0;
+
+void resolve_error(const char *fmt, const char *name, int line) {
+    fprintf(stderr, "Error: ");
+    fprintf(stderr, fmt, name);
+    fprintf(stderr, " (line %d)\n", line);
+    exit(1);
+}
+
+int find_func_index(Symbol *name) {
+    stat_func_lookups++;
+    for (int i = 0; i < func_count; i++) {
+        stat_func_compares++;
+        if (func_names[i] == name) return i;
+    }
+    return -1;
+}
+
+void begin_scope(FrameScope *fs) {
+    fs->scope++;
+}
+
+void end_scope(FrameScope *fs) {
+    while (fs->count > 0 && fs->names[fs->count - 1].scope == fs->scope) fs->count--;
+    fs->scope--;
+}
+
+ScopeName* lookup_scope(FrameScope *fs, Symbol *name) {
+    stat_scope_lookups++;
+    for (int i = fs->count - 1; i >= 0; i--) {
+        stat_scope_compares++;
+        if (fs->names[i].name == name) return &fs->names[i];
+    }
+    return NULL;
+}
+
+// Redeclaring a name in the same block reuses its slot.
+ScopeName* declare_name(FrameScope *fs, Symbol *name, int is_const) {
+    ScopeName *sn = lookup_scope(fs, name);
+    if (sn && sn->scope == fs->scope) {
+        sn->is_const = is_const;
+        return sn;
+    }
+    if (fs->count == fs->capacity) {
+        fs->capacity = fs->capacity ? fs->capacity * 2 : 16;
+        fs->names = realloc(fs->names, sizeof(ScopeName) * fs->capacity);
+    }
+    sn = &fs->names[fs->count++];
+    sn->name = name;
+    sn->slot = fs->slot_count++;
+    sn->is_const = is_const;
+    sn->scope = fs->scope;
+    return sn;
+}
+
+ScopeName* resolve_name(Symbol *name, int *depth) {
+    ScopeName *sn = lookup_scope(current_scope, name);
+    *depth = 0;
+    if (!sn && current_scope != &global_scope) {
+        sn = lookup_scope(&global_scope, name);
+        *depth = 1;
+    }
+    return sn;
+}
+
+// Hoists every function name so calls may precede declarations.
+void collect_functions(ASTNode *node) {
+    if (!node) return;
+    switch (node->type) {
+        case NODE_PROGRAM:
+        case NODE_BLOCK:
+            for (int i = 0; i < node->data.block.stmt_count; i++) {
+                collect_functions(node->data.block.statements[i]);
+            }
+            break;
+        case NODE_FUNC_DECL:
+            if (find_func_index(node->data.func.name) < 0) {
+                if (func_count == func_name_capacity) {
+                    func_name_capacity = func_name_capacity ? func_name_capacity * 2 : 16;
+                    func_names = realloc(func_names, sizeof(Symbol*) * func_name_capacity);
+                }
+                func_names[func_count++] = node->data.func.name;
+            }
+            if (func_decl_count == func_decl_capacity) {
+                func_decl_capacity = func_decl_capacity ? func_decl_capacity * 2 : 16;
+                func_decls = realloc(func_decls, sizeof(ASTNode*) * func_decl_capacity);
+            }
+            func_decls[func_decl_count++] = node;
+            collect_functions(node->data.func.body);
+            break;
+        case NODE_IF_STMT:
+            collect_functions(node->data.if_stmt.then_branch);
+            collect_functions(node->data.if_stmt.else_branch);
+            break;
+        case NODE_WHILE_STMT:
+            collect_functions(node->data.while_stmt.body);
+            break;
+        case NODE_FOR_STMT:
+            collect_functions(node->data.for_stmt.body);
+            break;
+        default:
+            break;
+    }
+}
+
+void resolve(ASTNode *node);
+
+void resolve_block(ASTNode *block) {
+    begin_scope(current_scope);
+    resolve(block);
+    end_scope(current_scope);
+}
+
+void resolve(ASTNode *node) {
+    if (!node) return;
+
+    switch (node->type) {
+        case NODE_PROGRAM:
+        case NODE_BLOCK:
+            for (int i = 0; i < node->data.block.stmt_count; i++) {
+                resolve(node->data.block.statements[i]);
+            }
+            break;
+
+        case NODE_FUNC_DECL: {
+            FrameScope *enclosing = current_scope;
+            FrameScope fs = {0};
+            current_scope = &fs;
+            // Parameters occupy the first slots of the frame
+            for (int i = 0; i < node->data.func.param_count; i++) {
+                declare_name(&fs, node->data.func.params[i], 0);
+            }
+            resolve(node->data.func.body);
+            current_scope = enclosing;
+            node->data.func.func_index = find_func_index(node->data.func.name);
+            node->data.func.slot_count = fs.slot_count;
+            free(fs.names);
+            break;
+        }
+
+        case NODE_VAR_DECL:
+            resolve(node->data.var.init);
+            node->data.var.slot = declare_name(current_scope, node->data.var.name,
+                                               node->data.var.is_const)->slot;
+            break;
+
+        case NODE_ASSIGN: {
+            resolve(node->data.binary.right);
+            ASTNode *target = node->data.binary.left;
+            int depth;
+            ScopeName *sn = resolve_name(target->data.identifier.name, &depth);
+            if (!sn) {
+                // Assigning an undeclared name declares it in the current block
+                sn = declare_name(current_scope, target->data.identifier.name, 0);
+                depth = 0;
+            } else if (sn->is_const) {
+                resolve_error("Cannot reassign const variable '%s'", target->data.identifier.name->name, node->line);
+            }
+            target->data.identifier.depth = depth;
+            target->data.identifier.slot = sn->slot;
+            break;
+        }
+
+        case NODE_IF_STMT:
+            resolve(node->data.if_stmt.condition);
+            resolve_block(node->data.if_stmt.then_branch);
+            if (node->data.if_stmt.else_branch) resolve_block(node->data.if_stmt.else_branch);
+            break;
+
+        case NODE_WHILE_STMT:
+            resolve(node->data.while_stmt.condition);
+            current_scope->loop_depth++;
+            resolve_block(node->data.while_stmt.body);
+            current_scope->loop_depth--;
+            break;
+
+        case NODE_FOR_STMT:
+            resolve(node->data.for_stmt.iterable);
+            begin_scope(current_scope);
+            node->data.for_stmt.slot = declare_name(current_scope, node->data.for_stmt.iterator, 0)->slot;
+            current_scope->loop_depth++;
+            resolve_block(node->data.for_stmt.body);
+            current_scope->loop_depth--;
+            end_scope(current_scope);
+            break;
+
+        case NODE_BREAK_STMT:
+        case NODE_CONTINUE_STMT:
+            if (current_scope->loop_depth == 0) {
+                resolve_error("'%s' outside of a loop",
+                              node->type == NODE_BREAK_STMT ? "break" : "continue", node->line);
+            }
+            break;
+
+        case NODE_RETURN_STMT:
+            resolve(node->data.return_stmt.value);
+            break;
+
+        case NODE_EXPR_STMT:
+            resolve(node->data.block.statements[0]);
+            break;
+
+        case NODE_BINARY_OP:
+            resolve(node->data.binary.left);
+            resolve(node->data.binary.right);
+            break;
+
+        case NODE_CALL:
+            for (int i = 0; i < node->data.call.arg_count; i++) {
+                resolve(node->data.call.args[i]);
+            }
+            // A user function of the same name shadows a builtin
+            node->data.call.func_index = find_func_index(node->data.call.name);
+            if (node->data.call.func_index < 0) {
+                Builtin *builtin = node->data.call.name->builtin;
+                int argc = node->data.call.arg_count;
+                if (!builtin) resolve_error("Function '%s' not found", node->data.call.name->name, node->line);
+                if (argc < builtin->min_args || (builtin->max_args >= 0 && argc > builtin->max_args)) {
+                    resolve_error("Wrong number of arguments to '%s'", builtin->name, node->line);
+                }
+                node->data.call.builtin = builtin;
+            }
+            break;
+
+        case NODE_IDENTIFIER: {
+            int depth;
+            ScopeName *sn = resolve_name(node->data.identifier.name, &depth);
+            if (!sn) resolve_error("Variable '%s' not found", node->data.identifier.name->name, node->line);
+            node->data.identifier.depth = depth;
+            node->data.identifier.slot = sn->slot;
+            break;
+        }
+
+        case NODE_ARRAY_LIT:
+            for (int i = 0; i < node->data.array.element_count; i++) {
+                resolve(node->data.array.elements[i]);
+            }
+            break;
+
+        case NODE_INDEX: {
+            int depth;
+            ScopeName *sn = resolve_name(node->data.index.name, &depth);
+            if (!sn) resolve_error("Variable '%s' not found", node->data.index.name->name, node->line);
+            node->data.index.depth = depth;
+            node->data.index.slot = sn->slot;
+            resolve(node->data.index.index);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+// Whether a function body reads or writes only its own frame: no
+// globals, no output or input, no function declarations, and calls only
+// to functions in `unsafe` that are not marked.
+int is_pure(ASTNode *node, int *unsafe) {
+    if (!node) return 1;
+    switch (node->type) {
+        case NODE_PROGRAM:
+        case NODE_BLOCK:
+            for (int i = 0; i < node->data.block.stmt_count; i++) {
+                if (!is_pure(node->data.block.statements[i], unsafe)) return 0;
+            }
+            return 1;
+        case NODE_FUNC_DECL:
+            return 0;
+        case NODE_VAR_DECL:
+            return is_pure(node->data.var.init, unsafe);
+        case NODE_ASSIGN:
+            return node->data.binary.left->data.identifier.depth == 0 && is_pure(node->data.binary.right, unsafe);
+        case NODE_IF_STMT:
+            return is_pure(node->data.if_stmt.condition, unsafe) && is_pure(node->data.if_stmt.then_branch, unsafe) &&
+                   is_pure(node->data.if_stmt.else_branch, unsafe);
+        case NODE_WHILE_STMT:
+            return is_pure(node->data.while_stmt.condition, unsafe) && is_pure(node->data.while_stmt.body, unsafe);
+        case NODE_FOR_STMT:
+            return is_pure(node->data.for_stmt.iterable, unsafe) && is_pure(node->data.for_stmt.body, unsafe);
+        case NODE_RETURN_STMT:
+            return is_pure(node->data.return_stmt.value, unsafe);
+        case NODE_EXPR_STMT:
+            return is_pure(node->data.block.statements[0], unsafe);
+        case NODE_BINARY_OP:
+            return is_pure(node->data.binary.left, unsafe) && is_pure(node->data.binary.right, unsafe);
+        case NODE_CALL:
+            for (int i = 0; i < node->data.call.arg_count; i++) {
+                if (!is_pure(node->data.call.args[i], unsafe)) return 0;
+            }
+            if (node->data.call.func_index < 0) return node->data.call.builtin->pure;
+            return !unsafe[node->data.call.func_index];
+        case NODE_IDENTIFIER:
+            return node->data.identifier.depth == 0;
+        case NODE_ARRAY_LIT:
+            for (int i = 0; i < node->data.array.element_count; i++) {
+                if (!is_pure(node->data.array.elements[i], unsafe)) return 0;
+            }
+            return 1;
+        case NODE_INDEX:
+            return node->data.index.depth == 0 && is_pure(node->data.index.index, unsafe);
+        default:
+            return 1;
+    }
+}
+
+// Gives each @memo function (or, with --auto-memo, each pure function) a
+// result cache. Calling a function is unsafe if its body is impure or if
+// it is declared more than once, since its behaviour then changes as the
+// program runs. Recursion is assumed safe until a body shows otherwise.
+void analyze_purity() {
+    int *unsafe = calloc(func_count + 1, sizeof(int));
+    int *seen = calloc(func_count + 1, sizeof(int));
+    for (int i = 0; i < func_decl_count; i++) {
+        int index = func_decls[i]->data.func.func_index;
+        if (seen[index]++) unsafe[index] = 1;
+    }
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = 0; i < func_decl_count; i++) {
+            ASTNode *decl = func_decls[i];
+            if (!unsafe[decl->data.func.func_index] && !is_pure(decl->data.func.body, unsafe)) {
+                unsafe[decl->data.func.func_index] = 1;
+                changed = 1;
+            }
+        }
+    }
+    for (int i = 0; i < func_decl_count; i++) {
+        ASTNode *decl = func_decls[i];
+        if (!decl->data.func.memo && !auto_memo) continue;
+        if (is_pure(decl->data.func.body, unsafe)) {
+            decl->data.func.cache = create_memo_cache(decl->data.func.param_count);
+        } else if (decl->data.func.memo) {
+            resolve_error("Function '%s' is not pure and cannot be memoized", decl->data.func.name->name, decl->line);
+        }
+    }
+    free(unsafe);
+    free(seen);
+}
+
+// Top-level declarations are visible to every function body, even ones
+// declared earlier in the file, so they are bound before the main pass.
+void resolve_program(ASTNode *program) {
+    collect_functions(program);
+    for (int i = 0; i < program->data.block.stmt_count; i++) {
+        ASTNode *stmt = program->data.block.statements[i];
+        if (!stmt) continue;
+        if (stmt->type == NODE_VAR_DECL) {
+            declare_name(&global_scope, stmt->data.var.name, stmt->data.var.is_const);
+        } else if (stmt->type == NODE_ASSIGN) {
+            Symbol *name = stmt->data.binary.left->data.identifier.name;
+            if (!lookup_scope(&global_scope, name)) declare_name(&global_scope, name, 0);
+        }
+    }
+    resolve(program);
+}
+
+// ============= OPTIMIZER =============
+// -O1 rewrites the resolved AST before it runs: constant operands are
+// folded with the runtime's own operator semantics, variables that only
+// ever hold one literal are replaced by it, branches on constant
+// conditions are taken at compile time, and statements that can never
+// run are dropped. Passes repeat until nothing changes.
+
+int optimize_level = 0;
+int dump_ast = 0;
+
+typedef enum { SLOT_UNSEEN, SLOT_CONST, SLOT_VARIES } SlotState;
+
+typedef struct {
+    SlotState state;
+    int constant;    // value of every store while SLOT_CONST
+    int position;    // top-level statement that declares it, or -1
+} ConstSlot;
+
+typedef struct {
+    ConstSlot *locals;   // the current frame; the globals at top level
+    ConstSlot *globals;
+    int position;        // top-level statement being rewritten, -1 in functions
+} OptContext;
+
+int opt_changed = 0;
+int opt_first_call = 0;  // first top-level statement that may run a user function
+
+const char *binary_op_names[] = {
+    "+", "-", "*", "/", "%", ">", "<", ">=", "<=", "==", "!=", "&&", "||", "="
+};
+
+void store_fact(ConstSlot *slot, ASTNode *value, int position) {
+    if (slot->state == SLOT_UNSEEN && value && value->type == NODE_LITERAL) {
+        slot->state = SLOT_CONST;
+        slot->constant = value->data.literal.constant;
+        slot->position = position;
+    } else {
+        slot->state = SLOT_VARIES;
+    }
+}
+
+// Records every store to a slot of `frame` (NULL inside nested function
+// bodies) and every store to a global from depth 1.
+void collect_facts(ASTNode *node, ConstSlot *frame, ConstSlot *globals, int position) {
+    if (!node) return;
+    switch (node->type) {
+        case NODE_PROGRAM:
+        case NODE_BLOCK:
+            for (int i = 0; i < node->data.block.stmt_count; i++) {
+                collect_facts(node->data.block.statements[i], frame, globals,
+                              node->type == NODE_PROGRAM ? i : -1);
+            }
+            break;
+        case NODE_FUNC_DECL:
+            collect_facts(node->data.func.body, NULL, globals, -1);
+            break;
+        case NODE_VAR_DECL:
+            if (frame) store_fact(&frame[node->data.var.slot], node->data.var.init, position);
+            break;
+        case NODE_ASSIGN: {
+            ASTNode *target = node->data.binary.left;
+            ConstSlot *slots = target->data.identifier.depth == 0 ? frame : globals;
+            if (slots) slots[target->data.identifier.slot].state = SLOT_VARIES;
+            break;
+        }
+        case NODE_IF_STMT:
+            collect_facts(node->data.if_stmt.then_branch, frame, globals, -1);
+            collect_facts(node->data.if_stmt.else_branch, frame, globals, -1);
+            break;
+        case NODE_WHILE_STMT:
+            collect_facts(node->data.while_stmt.body, frame, globals, -1);
+            break;
+        case NODE_FOR_STMT:
+            if (frame) frame[node->data.for_stmt.slot].state = SLOT_VARIES;
+            collect_facts(node->data.for_stmt.body, frame, globals, -1);
+            break;
+        default:
+            break;
+    }
+}
+
+int calls_user_function(ASTNode *node) {
+    if (!node) return 0;
+    switch (node->type) {
+        case NODE_PROGRAM:
+        case NODE_BLOCK:
+        case NODE_EXPR_STMT:
+            for (int i = 0; i < node->data.block.stmt_count; i++) {
+                if (calls_user_function(node->data.block.statements[i])) return 1;
+            }
+            return 0;
+        case NODE_FUNC_DECL:
+            return 0;
+        case NODE_VAR_DECL:
+            return calls_user_function(node->data.var.init);
+        case NODE_IF_STMT:
+            return calls_user_function(node->data.if_stmt.condition) ||
+                   calls_user_function(node->data.if_stmt.then_branch) ||
+                   calls_user_function(node->data.if_stmt.else_branch);
+        case NODE_WHILE_STMT:
+            return calls_user_function(node->data.while_stmt.condition) ||
+                   calls_user_function(node->data.while_stmt.body);
+        case NODE_FOR_STMT:
+            return calls_user_function(node->data.for_stmt.iterable) ||
+                   calls_user_function(node->data.for_stmt.body);
+        case NODE_RETURN_STMT:
+            return calls_user_function(node->data.return_stmt.value);
+        case NODE_BINARY_OP:
+        case NODE_ASSIGN:
+            return calls_user_function(node->data.binary.left) ||
+                   calls_user_function(node->data.binary.right);
+        case NODE_CALL:
+            if (node->data.call.func_index >= 0) return 1;
+            for (int i = 0; i < node->data.call.arg_count; i++) {
+                if (calls_user_function(node->data.call.args[i])) return 1;
+            }
+            return 0;
+        case NODE_ARRAY_LIT:
+            for (int i = 0; i < node->data.array.element_count; i++) {
+                if (calls_user_function(node->data.array.elements[i])) return 1;
+            }
+            return 0;
+        case NODE_INDEX:
+            return calls_user_function(node->data.index.index);
+        default:
+            return 0;
+    }
+}
+
+// Expressions that can be dropped without changing what the program does.
+int has_no_effects(ASTNode *node) {
+    switch (node->type) {
+        case NODE_LITERAL:
+        case NODE_IDENTIFIER:
+            return 1;
+        case NODE_BINARY_OP:
+            return has_no_effects(node->data.binary.left) && has_no_effects(node->data.binary.right);
+        default:
+            return 0;
+    }
+}
+
+// Expressions that always produce a bool, so `true && x` may become `x`.
+// Ordering comparisons are left out: mismatched operands yield null.
+int is_boolean(ASTNode *node) {
+    if (node->type == NODE_LITERAL) return constants[node->data.literal.constant].type == VAL_BOOL;
+    return node->type == NODE_BINARY_OP && node->data.binary.op >= BIN_EQ;
+}
+
+// Whether control never reaches the statement after this one.
+int ends_flow(ASTNode *node) {
+    if (!node) return 0;
+    switch (node->type) {
+        case NODE_RETURN_STMT:
+        case NODE_BREAK_STMT:
+        case NODE_CONTINUE_STMT:
+            return 1;
+        case NODE_BLOCK:
+            return node->data.block.stmt_count > 0 &&
+                   ends_flow(node->data.block.statements[node->data.block.stmt_count - 1]);
+        case NODE_IF_STMT:
+            return ends_flow(node->data.if_stmt.then_branch) && ends_flow(node->data.if_stmt.else_branch);
+        default:
+            return 0;
+    }
+}
+
+ASTNode* make_literal(int line, Value v) {
+    ASTNode *node = alloc_node(line);
+    node->type = NODE_LITERAL;
+    node->data.literal.constant = add_constant(v);
+    opt_changed = 1;
+    return node;
+}
+
+ASTNode* fold_binary(ASTNode *node) {
+    BinaryOp op = node->data.binary.op;
+    ASTNode *left = node->data.binary.left;
+    ASTNode *right = node->data.binary.right;
+
+    if (left->type == NODE_LITERAL && right->type == NODE_LITERAL) {
+        Value a = constants[left->data.literal.constant];
+        Value b = constants[right->data.literal.constant];
+        // Integer division by zero (or INT_MIN / -1) traps; leave it to runtime
+        if ((op == BIN_DIV || op == BIN_MOD) && (b.type == VAL_INT || b.type == VAL_BOOL) &&
+            (a.type == VAL_INT || a.type == VAL_BOOL) &&
+            (b.data.int_val == 0 || (b.data.int_val == -1 && a.data.int_val == INT_MIN))) {
+            return node;
+        }
+        return make_literal(node->line, binary_op(op, a, b));
+    }
+    if (op != BIN_AND && op != BIN_OR) return node;
+
+    // `false && x` and `true || x` never evaluate x
+    if (left->type == NODE_LITERAL) {
+        int truthy = is_truthy(constants[left->data.literal.constant]);
+        if (truthy == (op == BIN_OR)) return make_literal(node->line, create_bool(truthy));
+        if (is_boolean(right)) {
+            opt_changed = 1;
+            return right;
+        }
+        return node;
+    }
+    if (right->type == NODE_LITERAL) {
+        int truthy = is_truthy(constants[right->data.literal.constant]);
+        if (truthy == (op == BIN_OR)) {
+            if (has_no_effects(left)) return make_literal(node->line, create_bool(truthy));
+        } else if (is_boolean(left)) {
+            opt_changed = 1;
+            return left;
+        }
+    }
+    return node;
+}
+
+ASTNode* substitute_constant(ASTNode *node, OptContext *ctx) {
+    int depth = node->data.identifier.depth;
+    ConstSlot *slot = depth == 0 ? &ctx->locals[node->data.identifier.slot]
+                                 : &ctx->globals[node->data.identifier.slot];
+    if (slot->state != SLOT_CONST) return node;
+    // A top-level declaration is visible before it runs: from the code
+    // above it, and from functions called before it
+    if (slot->position >= 0) {
+        if (ctx->position >= 0 && slot->position >= ctx->position) return node;
+        if (ctx->position < 0 && depth == 1 && slot->position >= opt_first_call) return node;
+    }
+    return make_literal(node->line, constants[slot->constant]);
+}
+
+ASTNode* optimize(ASTNode *node, OptContext *ctx);
+
+void optimize_list(ASTNode **nodes, int count, OptContext *ctx) {
+    for (int i = 0; i < count; i++) nodes[i] = optimize(nodes[i], ctx);
+}
+
+void optimize_function(ASTNode *node, OptContext *ctx) {
+    ConstSlot *locals = calloc(node->data.func.slot_count + 1, sizeof(ConstSlot));
+    for (int i = 0; i < node->data.func.param_count; i++) locals[i].state = SLOT_VARIES;
+    collect_facts(node->data.func.body, locals, ctx->globals, -1);
+    OptContext inner = { locals, ctx->globals, -1 };
+    node->data.func.body = optimize(node->data.func.body, &inner);
+    free(locals);
+}
+
+// Returns the rewritten node; a statement that can never run becomes NULL.
+ASTNode* optimize(ASTNode *node, OptContext *ctx) {
+    if (!node) return NULL;
+
+    switch (node->type) {
+        case NODE_PROGRAM:
+        case NODE_BLOCK: {
+            int count = 0;
+            for (int i = 0; i < node->data.block.stmt_count; i++) {
+                if (node->type == NODE_PROGRAM) ctx->position = i;
+                ASTNode *stmt = optimize(node->data.block.statements[i], ctx);
+                if (!stmt) continue;
+                node->data.block.statements[count++] = stmt;
+                if (ends_flow(stmt)) break;
+            }
+            if (count < node->data.block.stmt_count) opt_changed = 1;
+            node->data.block.stmt_count = count;
+            return node;
+        }
+
+        case NODE_FUNC_DECL:
+            optimize_function(node, ctx);
+            return node;
+
+        case NODE_VAR_DECL:
+            node->data.var.init = optimize(node->data.var.init, ctx);
+            return node;
+
+        case NODE_IF_STMT: {
+            ASTNode *cond = optimize(node->data.if_stmt.condition, ctx);
+            node->data.if_stmt.condition = cond;
+            node->data.if_stmt.then_branch = optimize(node->data.if_stmt.then_branch, ctx);
+            node->data.if_stmt.else_branch = optimize(node->data.if_stmt.else_branch, ctx);
+            if (cond->type != NODE_LITERAL) return node;
+            opt_changed = 1;
+            return is_truthy(constants[cond->data.literal.constant]) ? node->data.if_stmt.then_branch
+                                                                      : node->data.if_stmt.else_branch;
+        }
+
+        case NODE_WHILE_STMT: {
+            ASTNode *cond = optimize(node->data.while_stmt.condition, ctx);
+            node->data.while_stmt.condition = cond;
+            if (cond->type == NODE_LITERAL && !is_truthy(constants[cond->data.literal.constant])) {
+                opt_changed = 1;
+                return NULL;
+            }
+            node->data.while_stmt.body = optimize(node->data.while_stmt.body, ctx);
+            return node;
+        }
+
+        case NODE_FOR_STMT:
+            node->data.for_stmt.iterable = optimize(node->data.for_stmt.iterable, ctx);
+            node->data.for_stmt.body = optimize(node->data.for_stmt.body, ctx);
+            return node;
+
+        case NODE_RETURN_STMT:
+            node->data.return_stmt.value = optimize(node->data.return_stmt.value, ctx);
+            return node;
+
+        case NODE_EXPR_STMT:
+            node->data.block.statements[0] = optimize(node->data.block.statements[0], ctx);
+            return node;
+
+        case NODE_ASSIGN:
+            node->data.binary.right = optimize(node->data.binary.right, ctx);
+            return node;
+
+        case NODE_BINARY_OP:
+            node->data.binary.left = optimize(node->data.binary.left, ctx);
+            node->data.binary.right = optimize(node->data.binary.right, ctx);
+            return fold_binary(node);
+
+        case NODE_CALL:
+            optimize_list(node->data.call.args, node->data.call.arg_count, ctx);
+            return node;
+
+        case NODE_IDENTIFIER:
+            return substitute_constant(node, ctx);
+
+        case NODE_ARRAY_LIT:
+            optimize_list(node->data.array.elements, node->data.array.element_count, ctx);
+            return node;
+
+        case NODE_INDEX:
+            node->data.index.index = optimize(node->data.index.index, ctx);
+            return node;
+
+        default:
+            return node;
+    }
+}
+
+void optimize_program(ASTNode *program) {
+    int global_count = global_scope.slot_count;
+    ConstSlot *globals = calloc(global_count + 1, sizeof(ConstSlot));
+    do {
+        opt_changed = 0;
+        memset(globals, 0, sizeof(ConstSlot) * (global_count + 1));
+        collect_facts(program, globals, globals, -1);
+        opt_first_call = program->data.block.stmt_count;
+        for (int i = 0; i < program->data.block.stmt_count; i++) {
+            if (calls_user_function(program->data.block.statements[i])) {
+                opt_first_call = i;
+                break;
+            }
+        }
+        OptContext ctx = { globals, globals, 0 };
+        optimize(program, &ctx);
+    } while (opt_changed);
+    free(globals);
+}
+
+void dump_node(ASTNode *node, int indent) {
+    if (!node) return;
+    printf("%*s", indent * 2, "");
+    switch (node->type) {
+        case NODE_PROGRAM:
+        case NODE_BLOCK:
+            printf("%s\n", node->type == NODE_PROGRAM ? "Program" : "Block");
+            for (int i = 0; i < node->data.block.stmt_count; i++) {
+                dump_node(node->data.block.statements[i], indent + 1);
+            }
+            break;
+        case NODE_FUNC_DECL:
+            printf("%sFunc %s(", node->data.func.memo ? "@memo " : "", node->data.func.name->name);
+            for (int i = 0; i < node->data.func.param_count; i++) {
+                printf("%s%s", i ? ", " : "", node->data.func.params[i]->name);
+            }
+            printf(") slots=%d\n", node->data.func.slot_count);
+            dump_node(node->data.func.body, indent + 1);
+            break;
+        case NODE_VAR_DECL:
+            printf("%s %s [slot %d]\n", node->data.var.is_const ? "Const" : "Var",
+                   node->data.var.name->name, node->data.var.slot);
+            dump_node(node->data.var.init, indent + 1);
+            break;
+        case NODE_IF_STMT:
+            printf("If\n");
+            dump_node(node->data.if_stmt.condition, indent + 1);
+            dump_node(node->data.if_stmt.then_branch, indent + 1);
+            if (node->data.if_stmt.else_branch) {
+                printf("%*sElse\n", indent * 2, "");
+                dump_node(node->data.if_stmt.else_branch, indent + 1);
+            }
+            break;
+        case NODE_WHILE_STMT:
+            printf("While\n");
+            dump_node(node->data.while_stmt.condition, indent + 1);
+            dump_node(node->data.while_stmt.body, indent + 1);
+            break;
+        case NODE_FOR_STMT:
+            printf("For %s [slot %d]\n", node->data.for_stmt.iterator->name, node->data.for_stmt.slot);
+            dump_node(node->data.for_stmt.iterable, indent + 1);
+            dump_node(node->data.for_stmt.body, indent + 1);
+            break;
+        case NODE_RETURN_STMT:
+            printf("Return\n");
+            dump_node(node->data.return_stmt.value, indent + 1);
+            break;
+        case NODE_BREAK_STMT:
+            printf("Break\n");
+            break;
+        case NODE_CONTINUE_STMT:
+            printf("Continue\n");
+            break;
+        case NODE_EXPR_STMT:
+            printf("Expr\n");
+            dump_node(node->data.block.statements[0], indent + 1);
+            break;
+        case NODE_ASSIGN:
+        case NODE_BINARY_OP:
+            printf("%s %s\n", node->type == NODE_ASSIGN ? "Assign" : "Binary",
+                   binary_op_names[node->data.binary.op]);
+            dump_node(node->data.binary.left, indent + 1);
+            dump_node(node->data.binary.right, indent + 1);
+            break;
+        case NODE_CALL:
+            printf("Call %s%s\n", node->data.call.name->name, node->data.call.func_index < 0 ? " [builtin]" : "");
+            for (int i = 0; i < node->data.call.arg_count; i++) {
+                dump_node(node->data.call.args[i], indent + 1);
+            }
+            break;
+        case NODE_LITERAL: {
+            Value v = constants[node->data.literal.constant];
+            char buf[NUMBER_BUF_LEN];
+            int length;
+            const char *text = format_value(v, buf, sizeof(buf), &length);
+            printf(v.type == VAL_STRING ? "Literal \"%.*s\"\n" : "Literal %.*s\n", length, text);
+            break;
+        }
+        case NODE_IDENTIFIER:
+            printf("Ident %s [%s %d]\n", node->data.identifier.name->name,
+                   node->data.identifier.depth ? "global" : "slot", node->data.identifier.slot);
+            break;
+        case NODE_ARRAY_LIT:
+            printf("Array\n");
+            for (int i = 0; i < node->data.array.element_count; i++) {
+                dump_node(node->data.array.elements[i], indent + 1);
+            }
+            break;
+        case NODE_INDEX:
+            printf("Index %s [%s %d]\n", node->data.index.name->name,
+                   node->data.index.depth ? "global" : "slot", node->data.index.slot);
+            dump_node(node->data.index.index, indent + 1);
+            break;
+        default:
+            printf("?\n");
+            break;
+    }
+}
+
+// ============= PROGRAM CACHE =============
+// A resolved (and, with -O1, optimized) program is saved to a .fldc file
+// so later runs of the same source skip the tokenizer, parser, resolver
+// and optimizer. Files are named by a hash of the source, the interpreter
+// build and the optimization level, and are written under a temporary
+// name and renamed into place. The format holds no pointers: symbols,
+// constants and nodes are tables, and nodes refer to each other and to
+// symbols and constants by index. A file whose header does not match
+// this interpreter and source exactly, whose checksum is wrong, or whose
+// slot and function indices do not fit its own tables, is a miss and the
+// program is parsed as usual.
+
+#define FLDC_FORMAT 1
+#define FLDC_MAGIC "FLDC"
+#ifndef FOLDR_BUILD_ID
+#define FOLDR_BUILD_ID ""                 // may be set by the build, e.g. to a commit id
+#endif
+
+typedef struct {
+    char magic[4];
+    int format;
+    char version[16];
+    unsigned long long build_id;
+    unsigned long long source_hash;
+    long long source_size;
+    int optimize_level;
+    int symbol_count;
+    int constant_count;
+    int node_count;
+    int func_count;          // function names and declarations follow the nodes
+    int func_decl_count;
+    int global_slots;
+    int payload_words;
+    unsigned long long checksum; // of the payload
+} CacheHeader;
+
+const char *cache_dir = NULL;    // NULL when caching is off
+
+// $FOLDR_CACHE_DIR, else $XDG_CACHE_HOME/foldr, else ~/.cache/foldr.
+const char* default_cache_dir() {
+    const char *dir = getenv("FOLDR_CACHE_DIR");
+    if (dir && *dir) return dir;
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *suffix = "/foldr";
+    if (!base || !*base) {
+        base = getenv("HOME");
+        suffix = "/.cache/foldr";
+    }
+    if (!base || !*base) return NULL;
+    char *path = malloc(strlen(base) + strlen(suffix) + 1);
+    strcpy(path, base);
+    strcat(path, suffix);
+    return path;
+}
+
+unsigned long long hash_bytes(unsigned long long h, const void *data, size_t size) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull; // FNV-1a, 64 bits
+    }
+    return h;
+}
+
+#define HASH_SEED 14695981039346656037ull
+
+// The payload is a stream of ints; strings are a length and their bytes
+// padded to a whole int.
+typedef struct {
+    int *words;
+    int count;
+    int capacity;
+} WordBuffer;
+
+void put_word(WordBuffer *out, int word) {
+    if (out->count == out->capacity) {
+        out->capacity = out->capacity ? out->capacity * 2 : 1024;
+        out->words = realloc(out->words, sizeof(int) * out->capacity);
+    }
+    out->words[out->count++] = word;
+}
+
+void put_bytes(WordBuffer *out, const char *bytes, int length) {
+    put_word(out, length);
+    int words = (length + 3) / 4;
+    for (int i = 0; i < words; i++) {
+        int word = 0;
+        int n = length - i * 4 < 4 ? length - i * 4 : 4;
+        memcpy(&word, bytes + i * 4, n);
+        put_word(out, word);
+    }
+}
+
+// Nodes are numbered in the order they are first referenced, so writing
+// node i may number nodes past i; they are written in turn.
+typedef struct {
+    WordBuffer nodes_out;
+    ASTNode **nodes;
+    int node_count;
+    int node_capacity;
+    ASTNode **map;           // open addressing, node -> its slot in `index`
+    int *index;
+    int map_capacity;
+    Symbol **symbols;        // Symbol.serial is 1 + the index here
+    int symbol_count;
+    int symbol_capacity;
+    int *constant_map;       // pool index -> 1 + index in the file, or 0
+    int *constants;          // pool indices, in the file's order
+    int constant_count;
+} CacheWriter;
+
+int cache_symbol(CacheWriter *w, Symbol *sym) {
+    if (!sym) return 0;
+    if (!sym->serial) {
+        if (w->symbol_count == w->symbol_capacity) {
+            w->symbol_capacity = w->symbol_capacity ? w->symbol_capacity * 2 : 64;
+            w->symbols = realloc(w->symbols, sizeof(Symbol*) * w->symbol_capacity);
+        }
+        w->symbols[w->symbol_count++] = sym;
+        sym->serial = w->symbol_count;
+    }
+    return sym->serial;
+}
+
+// Only the constants the program uses are written, so a pool shared with
+// other programs (as in a --serve child) does not leak into the file.
+int cache_constant(CacheWriter *w, int index) {
+    if (!w->constant_map[index]) {
+        w->constants[w->constant_count++] = index;
+        w->constant_map[index] = w->constant_count;
+    }
+    return w->constant_map[index] - 1;
+}
+
+unsigned pointer_hash(const void *p) {
+    return (unsigned)(((size_t)p >> 3) * 2654435761u);
+}
+
+void grow_node_map(CacheWriter *w) {
+    int capacity = w->map_capacity ? w->map_capacity * 2 : 1024;
+    ASTNode **map = calloc(capacity, sizeof(ASTNode*));
+    int *index = malloc(sizeof(int) * capacity);
+    for (int i = 0; i < w->map_capacity; i++) {
+        if (!w->map[i]) continue;
+        unsigned h = pointer_hash(w->map[i]) & (capacity - 1);
+        while (map[h]) h = (h + 1) & (capacity - 1);
+        map[h] = w->map[i];
+        index[h] = w->index[i];
+    }
+    free(w->map);
+    free(w->index);
+    w->map = map;
+    w->index = index;
+    w->map_capacity = capacity;
+}
+
+int cache_node(CacheWriter *w, ASTNode *node) {
+    if (!node) return -1;
+    if (w->node_count >= w->map_capacity * 3 / 4) grow_node_map(w);
+    unsigned h = pointer_hash(node) & (w->map_capacity - 1);
+    while (w->map[h]) {
+        if (w->map[h] == node) return w->index[h];
+        h = (h + 1) & (w->map_capacity - 1);
+    }
+    if (w->node_count == w->node_capacity) {
+        w->node_capacity = w->node_capacity ? w->node_capacity * 2 : 1024;
+        w->nodes = realloc(w->nodes, sizeof(ASTNode*) * w->node_capacity);
+    }
+    w->map[h] = node;
+    w->index[h] = w->node_count;
+    w->nodes[w->node_count] = node;
+    return w->node_count++;
+}
+
+void cache_node_list(CacheWriter *w, ASTNode **nodes, int count) {
+    put_word(&w->nodes_out, count);
+    for (int i = 0; i < count; i++) put_word(&w->nodes_out, cache_node(w, nodes[i]));
+}
+
+// Runtime state (specializations, loop analysis, memo caches) is not
+// written; a loaded node starts out as the resolver left it.
+void write_node(CacheWriter *w, ASTNode *node) {
+    WordBuffer *out = &w->nodes_out;
+    put_word(out, node->type);
+    put_word(out, node->line);
+    switch (node->type) {
+        case NODE_PROGRAM:
+        case NODE_BLOCK:
+        case NODE_EXPR_STMT:
+            cache_node_list(w, node->data.block.statements, node->data.block.stmt_count);
+            break;
+        case NODE_FUNC_DECL:
+            put_word(out, cache_symbol(w, node->data.func.name));
+            put_word(out, node->data.func.param_count);
+            for (int i = 0; i < node->data.func.param_count; i++) {
+                put_word(out, cache_symbol(w, node->data.func.params[i]));
+            }
+            put_word(out, cache_node(w, node->data.func.body));
+            put_word(out, cache_symbol(w, node->data.func.return_type));
+            put_word(out, node->data.func.func_index);
+            put_word(out, node->data.func.slot_count);
+            put_word(out, node->data.func.memo);
+            break;
+        case NODE_VAR_DECL:
+            put_word(out, cache_symbol(w, node->data.var.name));
+            put_word(out, cache_node(w, node->data.var.init));
+            put_word(out, cache_symbol(w, node->data.var.var_type));
+            put_word(out, node->data.var.is_const);
+            put_word(out, node->data.var.slot);
+            break;
+        case NODE_IF_STMT:
+            put_word(out, cache_node(w, node->data.if_stmt.condition));
+            put_word(out, cache_node(w, node->data.if_stmt.then_branch));
+            put_word(out, cache_node(w, node->data.if_stmt.else_branch));
+            break;
+        case NODE_FOR_STMT:
+            put_word(out, cache_symbol(w, node->data.for_stmt.iterator));
+            put_word(out, cache_node(w, node->data.for_stmt.iterable));
+            put_word(out, cache_node(w, node->data.for_stmt.body));
+            put_word(out, node->data.for_stmt.slot);
+            break;
+        case NODE_WHILE_STMT:
+            put_word(out, cache_node(w, node->data.while_stmt.condition));
+            put_word(out, cache_node(w, node->data.while_stmt.body));
+            break;
+        case NODE_RETURN_STMT:
+            put_word(out, cache_node(w, node->data.return_stmt.value));
+            break;
+        case NODE_BINARY_OP:
+        case NODE_BINARY_INT:
+        case NODE_BINARY_FLOAT:
+        case NODE_BINARY_CONCAT:
+        case NODE_ASSIGN:
+            put_word(out, node->data.binary.op);
+            put_word(out, cache_node(w, node->data.binary.left));
+            put_word(out, cache_node(w, node->data.binary.right));
+            break;
+        case NODE_CALL:
+            put_word(out, cache_symbol(w, node->data.call.name));
+            cache_node_list(w, node->data.call.args, node->data.call.arg_count);
+            put_word(out, node->data.call.func_index);
+            break;
+        case NODE_LITERAL:
+            put_word(out, cache_constant(w, node->data.literal.constant));
+            break;
+        case NODE_IDENTIFIER:
+            put_word(out, cache_symbol(w, node->data.identifier.name));
+            put_word(out, node->data.identifier.depth);
+            put_word(out, node->data.identifier.slot);
+            break;
+        case NODE_ARRAY_LIT:
+            cache_node_list(w, node->data.array.elements, node->data.array.element_count);
+            break;
+        case NODE_INDEX:
+            put_word(out, cache_symbol(w, node->data.index.name));
+            put_word(out, cache_node(w, node->data.index.index));
+            put_word(out, node->data.index.depth);
+            put_word(out, node->data.index.slot);
+            break;
+        default:
+            break;
+    }
+}
+
+// Returns 0 if a constant cannot be stored; such programs are not cached.
+int write_constants(CacheWriter *w, WordBuffer *out) {
+    for (int i = 0; i < w->constant_count; i++) {
+        Value v = constants[w->constants[i]];
+        put_word(out, v.type);
+        switch (v.type) {
+            case VAL_INT: put_word(out, v.data.int_val); break;
+            case VAL_BOOL: put_word(out, v.data.bool_val); break;
+            case VAL_FLOAT: {
+                int words[2];
+                memcpy(words, &v.data.float_val, sizeof(double));
+                put_word(out, words[0]);
+                put_word(out, words[1]);
+                break;
+            }
+            case VAL_STRING:
+                put_bytes(out, v.data.string_val->chars, v.data.string_val->length);
+                break;
+            case VAL_NULL: break;
+            default: return 0;
+        }
+    }
+    return 1;
+}
+
+// Directories of `path` that do not exist yet are created.
+void make_dirs(const char *path) {
+#ifndef _WIN32
+    char *copy = strdup(path);
+    for (char *p = copy + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        mkdir(copy, 0755);
+        *p = '/';
+    }
+    mkdir(copy, 0755);
+    free(copy);
+#endif
+}
+
+// Identifies the layout a saved program depends on, so that a rebuilt
+// interpreter whose nodes, operators or builtins changed misses the cache
+// even if FLDC_FORMAT was not bumped. Changes that keep the layout are
+// still FLDC_FORMAT's job; files they leave behind are caught by the
+// range checks in read_node and check_slots.
+unsigned long long cache_build_id() {
+    size_t layout[] = { sizeof(ASTNode), sizeof(Value), NODE_TYPE_COUNT, BIN_NONE, BUILTIN_COUNT };
+    unsigned long long id = hash_bytes(HASH_SEED, FOLDR_BUILD_ID, strlen(FOLDR_BUILD_ID));
+    return hash_bytes(id, layout, sizeof(layout));
+}
+
+// The key covers everything a saved program depends on besides its source.
+char* cache_path(unsigned long long source_hash) {
+    unsigned long long key = source_hash;
+    unsigned long long build_id = cache_build_id();
+    int format = FLDC_FORMAT;
+    key = hash_bytes(key, VERSION, strlen(VERSION));
+    key = hash_bytes(key, &build_id, sizeof(build_id));
+    key = hash_bytes(key, &format, sizeof(format));
+    key = hash_bytes(key, &optimize_level, sizeof(optimize_level));
+    size_t length = strlen(cache_dir) + 32;
+    char *path = malloc(length);
+    snprintf(path, length, "%s/%016llx.fldc", cache_dir, key);
+    return path;
+}
+
+void init_cache_header(CacheHeader *h, unsigned long long source_hash, size_t source_size) {
+    memset(h, 0, sizeof(CacheHeader));
+    memcpy(h->magic, FLDC_MAGIC, 4);
+    h->format = FLDC_FORMAT;
+    strncpy(h->version, VERSION, sizeof(h->version) - 1);
+    h->build_id = cache_build_id();
+    h->source_hash = source_hash;
+    h->source_size = source_size;
+    h->optimize_level = optimize_level;
+}
+
+// Serializes a resolved program into a header and payload. Returns 0 if
+// it holds something the format cannot store.
+int encode_program(ASTNode *program, unsigned long long source_hash, size_t source_size,
+                   CacheHeader *h, WordBuffer *payload) {
+    CacheWriter w;
+    memset(&w, 0, sizeof(w));
+    w.constant_map = calloc(constant_count + 1, sizeof(int));
+    w.constants = malloc(sizeof(int) * (constant_count + 1));
+    cache_node(&w, program);
+    for (int i = 0; i < func_decl_count; i++) cache_node(&w, func_decls[i]);
+    for (int i = 0; i < w.node_count; i++) write_node(&w, w.nodes[i]);
+    for (int i = 0; i < func_count; i++) put_word(&w.nodes_out, cache_symbol(&w, func_names[i]));
+    for (int i = 0; i < func_decl_count; i++) put_word(&w.nodes_out, cache_node(&w, func_decls[i]));
+
+    memset(payload, 0, sizeof(WordBuffer));
+    for (int i = 0; i < w.symbol_count; i++) {
+        put_bytes(payload, w.symbols[i]->name, w.symbols[i]->length);
+        w.symbols[i]->serial = 0;
+    }
+    int ok = write_constants(&w, payload);
+    for (int i = 0; i < w.nodes_out.count; i++) put_word(payload, w.nodes_out.words[i]);
+
+    init_cache_header(h, source_hash, source_size);
+    h->symbol_count = w.symbol_count;
+    h->constant_count = w.constant_count;
+    h->node_count = w.node_count;
+    h->func_count = func_count;
+    h->func_decl_count = func_decl_count;
+    h->global_slots = global_scope.slot_count;
+    h->payload_words = payload->count;
+    h->checksum = hash_bytes(HASH_SEED, payload->words, sizeof(int) * payload->count);
+
+    free(w.nodes_out.words);
+    free(w.nodes);
+    free(w.map);
+    free(w.index);
+    free(w.symbols);
+    free(w.constant_map);
+    free(w.constants);
+    return ok;
+}
+
+// Saving is best effort: a cache that cannot be written is skipped quietly.
+void save_cached_program(const char *path, ASTNode *program, unsigned long long source_hash, size_t source_size) {
+#ifndef _WIN32
+    CacheHeader h;
+    WordBuffer payload;
+    if (encode_program(program, source_hash, source_size, &h, &payload)) {
+        make_dirs(cache_dir);
+        size_t length = strlen(path) + 32;
+        char *temp = malloc(length);
+        snprintf(temp, length, "%s.%d.tmp", path, (int)getpid());
+        FILE *file = fopen(temp, "wb");
+        int written = file && fwrite(&h, sizeof(h), 1, file) == 1 &&
+                      fwrite(payload.words, sizeof(int), payload.count, file) == (size_t)payload.count;
+        if (file && fclose(file) != 0) written = 0;
+        if (!written || rename(temp, path) != 0) unlink(temp);
+        free(temp);
+    }
+    free(payload.words);
+#endif
+}
+
+typedef struct {
+    const int *words;
+    int count;
+    int pos;
+    int failed;
+    char *parented;          // nodes another node already refers to
+} WordReader;
+
+int get_word(WordReader *in) {
+    if (in->pos >= in->count) {
+        in->failed = 1;
+        return 0;
+    }
+    return in->words[in->pos++];
+}
+
+const char* get_bytes(WordReader *in, int *length) {
+    *length = get_word(in);
+    int words = (*length + 3) / 4;
+    if (*length < 0 || words > in->count - in->pos) {
+        in->failed = 1;
+        *length = 0;
+        return "";
+    }
+    const char *bytes = (const char*)(in->words + in->pos);
+    in->pos += words;
+    return bytes;
+}
+
+// Out-of-range indices mark the file bad rather than being followed, as
+// does a second reference to a node: a program is a tree, and one with
+// shared nodes or cycles could make check_slots take exponential time.
+ASTNode* get_node(WordReader *in, ASTNode **nodes, int count) {
+    int i = get_word(in);
+    if (i < -1 || i >= count) in->failed = 1;
+    if (i < 0 || i >= count) return NULL;
+    if (in->parented) {
+        if (in->parented[i]) in->failed = 1;
+        in->parented[i] = 1;
+    }
+    return nodes[i];
+}
+
+Symbol* get_symbol(WordReader *in, Symbol **symbols, int count) {
+    int i = get_word(in);
+    if (i < 0 || i > count) in->failed = 1;
+    return i > 0 && i <= count ? symbols[i - 1] : NULL;
+}
+
+ASTNode** get_node_list(WordReader *in, ASTNode **nodes, int count, int *length) {
+    *length = get_word(in);
+    if (*length < 0 || *length > in->count - in->pos) {
+        in->failed = 1;
+        *length = 0;
+    }
+    ASTNode **list = arena_alloc(&ast_arena, sizeof(ASTNode*) * (*length > 0 ? *length : 1));
+    for (int i = 0; i < *length; i++) list[i] = get_node(in, nodes, count);
+    return list;
+}
+
+// Indices into the function table are checked against the header here;
+// slots depend on the enclosing frame and are checked by check_slots.
+void read_node(WordReader *in, ASTNode *node, ASTNode **nodes, int count, Symbol **symbols, int symbol_count,
+               int base_constant, const CacheHeader *h) {
+    node->type = get_word(in);
+    node->line = get_word(in);
+    switch (node->type) {
+        case NODE_PROGRAM:
+        case NODE_BLOCK:
+        case NODE_EXPR_STMT:
+            node->data.block.statements = get_node_list(in, nodes, count, &node->data.block.stmt_count);
+            break;
+        case NODE_FUNC_DECL: {
+            node->data.func.name = get_symbol(in, symbols, symbol_count);
+            int params = get_word(in);
+            if (params < 0 || params > in->count - in->pos) {
+                in->failed = 1;
+                return;
+            }
+            node->data.func.param_count = params;
+            node->data.func.params = arena_alloc(&ast_arena, sizeof(Symbol*) * (params > 0 ? params : 1));
+            for (int i = 0; i < params; i++) node->data.func.params[i] = get_symbol(in, symbols, symbol_count);
+            node->data.func.body = get_node(in, nodes, count);
+            node->data.func.return_type = get_symbol(in, symbols, symbol_count);
+            node->data.func.func_index = get_word(in);
+            node->data.func.slot_count = get_word(in);
+            node->data.func.memo = get_word(in);
+            if (node->data.func.func_index < 0 || node->data.func.func_index >= h->func_count ||
+                node->data.func.slot_count < params) {
+                in->failed = 1;
+            }
+            break;
+        }
+        case NODE_VAR_DECL:
+            node->data.var.name = get_symbol(in, symbols, symbol_count);
+            node->data.var.init = get_node(in, nodes, count);
+            node->data.var.var_type = get_symbol(in, symbols, symbol_count);
+            node->data.var.is_const = get_word(in);
+            node->data.var.slot = get_word(in);
+            break;
+        case NODE_IF_STMT:
+            node->data.if_stmt.condition = get_node(in, nodes, count);
+            node->data.if_stmt.then_branch = get_node(in, nodes, count);
+            node->data.if_stmt.else_branch = get_node(in, nodes, count);
+            break;
+        case NODE_FOR_STMT:
+            node->data.for_stmt.iterator = get_symbol(in, symbols, symbol_count);
+            node->data.for_stmt.iterable = get_node(in, nodes, count);
+            node->data.for_stmt.body = get_node(in, nodes, count);
+            node->data.for_stmt.slot = get_word(in);
+            break;
+        case NODE_WHILE_STMT:
+            node->data.while_stmt.condition = get_node(in, nodes, count);
+            node->data.while_stmt.body = get_node(in, nodes, count);
+            break;
+        case NODE_RETURN_STMT:
+            node->data.return_stmt.value = get_node(in, nodes, count);
+            break;
+        case NODE_BINARY_OP:
+        case NODE_BINARY_INT:
+        case NODE_BINARY_FLOAT:
+        case NODE_BINARY_CONCAT:
+        case NODE_ASSIGN:
+            node->data.binary.op = get_word(in);
+            node->data.binary.left = get_node(in, nodes, count);
+            node->data.binary.right = get_node(in, nodes, count);
+            if (node->data.binary.op < BIN_ADD || node->data.binary.op > BIN_NONE) in->failed = 1;
+            break;
+        case NODE_CALL:
+            node->data.call.name = get_symbol(in, symbols, symbol_count);
+            node->data.call.args = get_node_list(in, nodes, count, &node->data.call.arg_count);
+            node->data.call.func_index = get_word(in);
+            if (node->data.call.func_index < -1 || node->data.call.func_index >= h->func_count) {
+                in->failed = 1;
+            } else if (node->data.call.func_index < 0) {
+                node->data.call.builtin = node->data.call.name ? node->data.call.name->builtin : NULL;
+                if (!node->data.call.builtin) in->failed = 1;
+            }
+            break;
+        case NODE_LITERAL:
+            node->data.literal.constant = base_constant + get_word(in);
+            if (node->data.literal.constant < base_constant || node->data.literal.constant >= constant_count) in->failed = 1;
+            break;
+        case NODE_IDENTIFIER:
+            node->data.identifier.name = get_symbol(in, symbols, symbol_count);
+            node->data.identifier.depth = get_word(in);
+            node->data.identifier.slot = get_word(in);
+            if (node->data.identifier.depth < 0 || node->data.identifier.depth > 1) in->failed = 1;
+            break;
+        case NODE_ARRAY_LIT:
+            node->data.array.elements = get_node_list(in, nodes, count, &node->data.array.element_count);
+            break;
+        case NODE_INDEX:
+            node->data.index.name = get_symbol(in, symbols, symbol_count);
+            node->data.index.index = get_node(in, nodes, count);
+            node->data.index.depth = get_word(in);
+            node->data.index.slot = get_word(in);
+            if (node->data.index.depth < 0 || node->data.index.depth > 1) in->failed = 1;
+            break;
+        case NODE_BREAK_STMT:
+        case NODE_CONTINUE_STMT:
+            break;
+        default:
+            in->failed = 1;
+            break;
+    }
+}
+
+// Whether every slot under `node` lies inside its frame: `frame_slots`
+// for depth 0 and the global frame for depth 1. Each function body is
+// checked against its own slot count. get_node has made sure the nodes
+// form a tree, so each is visited once.
+int check_slots(ASTNode *node, int frame_slots, int global_slots) {
+    if (!node) return 1;
+    switch (node->type) {
+        case NODE_PROGRAM:
+        case NODE_BLOCK:
+        case NODE_EXPR_STMT:
+            for (int i = 0; i < node->data.block.stmt_count; i++) {
+                if (!check_slots(node->data.block.statements[i], frame_slots, global_slots)) return 0;
+            }
+            return 1;
+        case NODE_FUNC_DECL:
+            return check_slots(node->data.func.body, node->data.func.slot_count, global_slots);
+        case NODE_VAR_DECL:
+            return node->data.var.slot >= 0 && node->data.var.slot < frame_slots &&
+                   check_slots(node->data.var.init, frame_slots, global_slots);
+        case NODE_IF_STMT:
+            return check_slots(node->data.if_stmt.condition, frame_slots, global_slots) &&
+                   check_slots(node->data.if_stmt.then_branch, frame_slots, global_slots) &&
+                   check_slots(node->data.if_stmt.else_branch, frame_slots, global_slots);
+        case NODE_FOR_STMT:
+            return node->data.for_stmt.slot >= 0 && node->data.for_stmt.slot < frame_slots &&
+                   check_slots(node->data.for_stmt.iterable, frame_slots, global_slots) &&
+                   check_slots(node->data.for_stmt.body, frame_slots, global_slots);
+        case NODE_WHILE_STMT:
+            return check_slots(node->data.while_stmt.condition, frame_slots, global_slots) &&
+                   check_slots(node->data.while_stmt.body, frame_slots, global_slots);
+        case NODE_RETURN_STMT:
+            return check_slots(node->data.return_stmt.value, frame_slots, global_slots);
+        case NODE_BINARY_OP:
+        case NODE_BINARY_INT:
+        case NODE_BINARY_FLOAT:
+        case NODE_BINARY_CONCAT:
+        case NODE_ASSIGN:
+            return check_slots(node->data.binary.left, frame_slots, global_slots) &&
+                   check_slots(node->data.binary.right, frame_slots, global_slots);
+        case NODE_CALL:
+            for (int i = 0; i < node->data.call.arg_count; i++) {
+                if (!check_slots(node->data.call.args[i], frame_slots, global_slots)) return 0;
+            }
+            return 1;
+        case NODE_IDENTIFIER:
+            return node->data.identifier.slot >= 0 &&
+                   node->data.identifier.slot < (node->data.identifier.depth ? global_slots : frame_slots);
+        case NODE_ARRAY_LIT:
+            for (int i = 0; i < node->data.array.element_count; i++) {
+                if (!check_slots(node->data.array.elements[i], frame_slots, global_slots)) return 0;
+            }
+            return 1;
+        case NODE_INDEX:
+            return node->data.index.slot >= 0 &&
+                   node->data.index.slot < (node->data.index.depth ? global_slots : frame_slots) &&
+                   check_slots(node->data.index.index, frame_slots, global_slots);
+        default:
+            return 1;
+    }
+}
+
+int read_constants(WordReader *in, int count) {
+    for (int i = 0; i < count && !in->failed; i++) {
+        Value v;
+        v.type = get_word(in);
+        switch (v.type) {
+            case VAL_INT: v.data.int_val = get_word(in); break;
+            case VAL_BOOL: v.data.bool_val = get_word(in); break;
+            case VAL_FLOAT: {
+                int words[2];
+                words[0] = get_word(in);
+                words[1] = get_word(in);
+                memcpy(&v.data.float_val, words, sizeof(double));
+                break;
+            }
+            case VAL_STRING: {
+                int length;
+                const char *chars = get_bytes(in, &length);
+                v = create_string_span(chars, length);
+                break;
+            }
+            case VAL_NULL: break;
+            default: in->failed = 1; break;
+        }
+        add_constant(v);
+    }
+    return !in->failed;
+}
+
+// Rebuilds a program from the `size` bytes of a .fldc image, filling in
+// the resolver's tables, or returns NULL if the image is not a valid one
+// for this source.
+ASTNode* decode_program(const char *data, size_t size, unsigned long long source_hash, size_t source_size) {
+    if (size < sizeof(CacheHeader)) return NULL;
+    CacheHeader h, expected;
+    memcpy(&h, data, sizeof(h));
+    init_cache_header(&expected, source_hash, source_size);
+    WordReader in = { (const int*)(data + sizeof(h)), h.payload_words, 0, 0, NULL };
+    if (memcmp(h.magic, expected.magic, 4) != 0 || h.format != expected.format ||
+        memcmp(h.version, expected.version, sizeof(h.version)) != 0 ||
+        h.source_hash != source_hash || h.source_size != (long long)source_size ||
+        h.build_id != expected.build_id || h.optimize_level != optimize_level || h.payload_words < 0 ||
+        (size - sizeof(h)) / sizeof(int) != (size_t)h.payload_words ||
+        h.symbol_count < 0 || h.constant_count < 0 || h.node_count < 1 ||
+        h.func_count < 0 || h.func_decl_count < 0 || h.global_slots < 0 ||
+        h.checksum != hash_bytes(HASH_SEED, in.words, sizeof(int) * (size_t)h.payload_words)) {
+        return NULL;
+    }
+
+    int base_constant = constant_count;
+    long base_nodes = ast_node_count;
+    Symbol **symbols = malloc(sizeof(Symbol*) * (h.symbol_count + 1));
+    ASTNode **nodes = malloc(sizeof(ASTNode*) * h.node_count);
+    Symbol **names = malloc(sizeof(Symbol*) * (h.func_count + 1));
+    ASTNode **decls = malloc(sizeof(ASTNode*) * (h.func_decl_count + 1));
+    for (int i = 0; i < h.symbol_count && !in.failed; i++) {
+        int length;
+        const char *name = get_bytes(&in, &length);
+        symbols[i] = intern(name, length);
+    }
+    read_constants(&in, h.constant_count);
+    if (!in.failed) {
+        for (int i = 0; i < h.node_count; i++) nodes[i] = alloc_node(0);
+        in.parented = calloc(h.node_count, 1);
+        in.parented[0] = 1;  // the root
+    }
+    for (int i = 0; i < h.node_count && !in.failed; i++) {
+        read_node(&in, nodes[i], nodes, h.node_count, symbols, h.symbol_count, base_constant, &h);
+    }
+    // Declarations are listed again after the tree
+    free(in.parented);
+    in.parented = NULL;
+    for (int i = 0; i < h.func_count && !in.failed; i++) {
+        names[i] = get_symbol(&in, symbols, h.symbol_count);
+    }
+    for (int i = 0; i < h.func_decl_count && !in.failed; i++) {
+        decls[i] = get_node(&in, nodes, h.node_count);
+        if (!decls[i] || decls[i]->type != NODE_FUNC_DECL) in.failed = 1;
+    }
+    free(symbols);
+    if (!in.failed && !check_slots(nodes[0], h.global_slots, h.global_slots)) in.failed = 1;
+
+    ASTNode *program = in.failed ? NULL : nodes[0];
+    free(nodes);
+    if (!program || program->type != NODE_PROGRAM) {
+        constant_count = base_constant;
+        ast_node_count = base_nodes;
+        free(names);
+        free(decls);
+        return NULL;
+    }
+    func_count = h.func_count;
+    func_names = names;
+    func_name_capacity = h.func_count + 1;
+    func_decls = decls;
+    func_decl_count = func_decl_capacity = h.func_decl_count;
+    global_scope.slot_count = h.global_slots;
+    return program;
+}
+
+// Returns the saved program for this source, or NULL if there is no
+// usable file.
+ASTNode* load_cached_program(const char *path, unsigned long long source_hash, size_t source_size) {
+#ifdef _WIN32
+    return NULL;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(CacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = st.st_size;
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+    ASTNode *program = decode_program(data, size, source_hash, source_size);
+    munmap((void*)data, size);
+    return program;
+#endif
+}
+
+// ============= PROFILER =============
+// --profile samples the running program every millisecond of wall time.
+// The timer signal only bumps a counter; each engine checks it at its
+// safe points (every task in the tree-walker, jumps and calls in the VM)
+// and records the current line and call stack there, weighted by the
+// ticks since the last sample. Calls are counted exactly. The report goes
+// to stderr at exit; --profile=FILE also writes the stacks to FILE in the
+// folded format read by flame graph tools.
+
+#define PROFILE_INTERVAL_US 1000
+#define PROFILE_MAX_DEPTH 256    // deeper stacks keep both ends
+#define PROFILE_TOP_LINES 20
+
+typedef struct {
+    int *frames;     // profile ids, outermost first
+    int depth;
+    unsigned int hash;
+    long samples;
+} ProfileStack;
+
+volatile sig_atomic_t profile_ticks = 0;
+int profiling = 0;
+const char *profile_path = NULL;   // folded stacks output, if any
+const char *profile_script = NULL;
+struct timespec profile_start;
+long profile_samples = 0;
+long profile_stamp = 0;            // sample number, for total counts
+// Per function index; func_count is the top level and func_count + 1
+// stands for the frames left out of a deep stack
+long *profile_self = NULL;
+long *profile_total = NULL;
+long *profile_calls = NULL;
+long *profile_seen = NULL;
+long *profile_lines = NULL;        // self samples per source line
+int profile_line_capacity = 0;
+ProfileStack *profile_stacks = NULL;
+int profile_stack_count = 0;
+int profile_stack_capacity = 0;
+int *profile_frames = NULL;        // stack being sampled
+int profile_depth = 0;
+int profile_frame_capacity = 0;
+long *profile_sort_key = NULL;
+
+void profile_tick(int sig) {
+    profile_ticks++;
+}
+
+const char* profile_name(int id) {
+    if (id == func_count) return "<top>";
+    if (id == func_count + 1) return "...";
+    return func_names[id]->name;
+}
+
+void* grow_stack(void *items, int *capacity, size_t item_size, int initial);
+
+void profile_push(int id) {
+    if (profile_depth == profile_frame_capacity) {
+        profile_frames = grow_stack(profile_frames, &profile_frame_capacity, sizeof(int), 64);
+    }
+    profile_frames[profile_depth++] = id;
+}
+
+// Collects the ids of `count` frames, outermost first; frame_func gives
+// the function index of frame i, or -1 for the top level.
+void profile_walk(int count, int (*frame_func)(int)) {
+    profile_depth = 0;
+    for (int i = 0; i < count; i++) {
+        if (count > PROFILE_MAX_DEPTH && i == PROFILE_MAX_DEPTH / 2) {
+            profile_push(func_count + 1);
+            i = count - PROFILE_MAX_DEPTH / 2;
+        }
+        int index = frame_func(i);
+        profile_push(index < 0 ? func_count : index);
+    }
+}
+
+void profile_count_stack(long weight) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < profile_depth; i++) hash = (hash ^ (unsigned int)profile_frames[i]) * 16777619u;
+
+    if (profile_stack_count * 2 >= profile_stack_capacity) {
+        int capacity = profile_stack_capacity ? profile_stack_capacity * 2 : 256;
+        ProfileStack *stacks = calloc(capacity, sizeof(ProfileStack));
+        for (int i = 0; i < profile_stack_capacity; i++) {
+            if (!profile_stacks[i].frames) continue;
+            int j = profile_stacks[i].hash & (capacity - 1);
+            while (stacks[j].frames) j = (j + 1) & (capacity - 1);
+            stacks[j] = profile_stacks[i];
+        }
+        free(profile_stacks);
+        profile_stacks = stacks;
+        profile_stack_capacity = capacity;
+    }
+
+    int j = hash & (profile_stack_capacity - 1);
+    for (ProfileStack *s; (s = &profile_stacks[j])->frames; j = (j + 1) & (profile_stack_capacity - 1)) {
+        if (s->hash == hash && s->depth == profile_depth &&
+            memcmp(s->frames, profile_frames, sizeof(int) * profile_depth) == 0) {
+            s->samples += weight;
+            return;
+        }
+    }
+    ProfileStack *s = &profile_stacks[j];
+    s->frames = malloc(sizeof(int) * (profile_depth ? profile_depth : 1));
+    memcpy(s->frames, profile_frames, sizeof(int) * profile_depth);
+    s->depth = profile_depth;
+    s->hash = hash;
+    s->samples = weight;
+    profile_stack_count++;
+}
+
+// Records the walked stack, running `line`, for every tick since the
+// last sample.
+void profile_sample(int line) {
+    long weight = profile_ticks;
+    profile_ticks = 0;
+    if (weight <= 0 || profile_depth == 0) return;
+    profile_samples += weight;
+    profile_stamp++;
+
+    profile_self[profile_frames[profile_depth - 1]] += weight;
+    for (int i = 0; i < profile_depth; i++) {
+        int id = profile_frames[i];
+        if (profile_seen[id] != profile_stamp) {
+            profile_seen[id] = profile_stamp;
+            profile_total[id] += weight;
+        }
+    }
+    if (line >= profile_line_capacity) {
+        int capacity = profile_line_capacity ? profile_line_capacity : 256;
+        while (capacity <= line) capacity *= 2;
+        profile_lines = realloc(profile_lines, sizeof(long) * capacity);
+        memset(profile_lines + profile_line_capacity, 0, sizeof(long) * (capacity - profile_line_capacity));
+        profile_line_capacity = capacity;
+    }
+    profile_lines[line] += weight;
+    profile_count_stack(weight);
+}
+
+int profile_compare(const void *a, const void *b) {
+    long ka = profile_sort_key[*(const int*)a], kb = profile_sort_key[*(const int*)b];
+    if (ka != kb) return ka < kb ? 1 : -1;
+    return *(const int*)a - *(const int*)b;
+}
+
+int declared_line(int index) {
+    for (int i = 0; i < func_decl_count; i++) {
+        if (func_decls[i]->data.func.func_index == index) return func_decls[i]->line;
+    }
+    return 0;
+}
+
+void write_folded_stacks() {
+    FILE *out = fopen(profile_path, "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot write profile to '%s'\n", profile_path);
+        return;
+    }
+    for (int i = 0; i < profile_stack_capacity; i++) {
+        ProfileStack *s = &profile_stacks[i];
+        if (!s->frames) continue;
+        for (int j = 0; j < s->depth; j++) {
+            fprintf(out, "%s%s", j ? ";" : "", profile_name(s->frames[j]));
+        }
+        fprintf(out, " %ld\n", s->samples);
+    }
+    fclose(out);
+}
+
+// Runs at exit, so programs that stop with an error are profiled too.
+void profile_report() {
+#ifndef _WIN32
+    struct itimerval off = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_REAL, &off, NULL);
+#endif
+    flush_output();
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - profile_start.tv_sec) + (end.tv_nsec - profile_start.tv_nsec) / 1e9;
+    double ms = PROFILE_INTERVAL_US / 1000.0;
+    double percent = profile_samples ? 100.0 / profile_samples : 0;
+
+    fprintf(stderr, "\nProfile of %s: %ld samples every %.0f ms, %.3f s wall time\n\n",
+            profile_script, profile_samples, ms, elapsed);
+
+    int count = func_count + 1;
+    int *order = malloc(sizeof(int) * (count > profile_line_capacity ? count : profile_line_capacity + 1));
+    for (int i = 0; i < count; i++) order[i] = i;
+    profile_sort_key = profile_self;
+    qsort(order, count, sizeof(int), profile_compare);
+    fprintf(stderr, "  self%%  total%%   self ms       calls  function\n");
+    for (int i = 0; i < count; i++) {
+        int id = order[i];
+        if (!profile_total[id] && !profile_calls[id]) continue;
+        fprintf(stderr, "  %5.1f  %6.1f  %8.0f", profile_self[id] * percent, profile_total[id] * percent,
+                profile_self[id] * ms);
+        if (id == func_count) fprintf(stderr, "  %10s  <top>\n", "-");
+        else fprintf(stderr, "  %10ld  %s (line %d)\n", profile_calls[id], profile_name(id), declared_line(id));
+    }
+
+    int lines = 0;
+    for (int i = 0; i < profile_line_capacity; i++) {
+        if (profile_lines[i]) order[lines++] = i;
+    }
+    profile_sort_key = profile_lines;
+    qsort(order, lines, sizeof(int), profile_compare);
+    fprintf(stderr, "\n  self%%   self ms  line\n");
+    for (int i = 0; i < lines && i < PROFILE_TOP_LINES; i++) {
+        fprintf(stderr, "  %5.1f  %8.0f  %d\n", profile_lines[order[i]] * percent, profile_lines[order[i]] * ms, order[i]);
+    }
+    free(order);
+
+    if (profile_path) write_folded_stacks();
+}
+
+void start_profiler(const char *script) {
+#ifdef _WIN32
+    fprintf(stderr, "Error: --profile is not supported on this platform\n");
+    exit(1);
+#else
+    profile_script = script;
+    profile_self = calloc(func_count + 2, sizeof(long));
+    profile_total = calloc(func_count + 2, sizeof(long));
+    profile_calls = calloc(func_count + 2, sizeof(long));
+    profile_seen = calloc(func_count + 2, sizeof(long));
+    profiling = 1;
+    atexit(profile_report);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profile_tick;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGALRM, &action, NULL);
+    struct itimerval timer = {{0, PROFILE_INTERVAL_US}, {0, PROFILE_INTERVAL_US}};
+    clock_gettime(CLOCK_MONOTONIC, &profile_start);
+    setitimer(ITIMER_REAL, &timer, NULL);
+#endif
+}
+
+// ============= INTERPRETER =============
+// The tree is walked without recursing on the C stack. Pending work is a
+// stack of tasks, one per node being evaluated, each remembering how far
+// it has got; expressions leave their result on the value stack. A call
+// frame is a window of the value stack holding the resolver's slots, with
+// the globals as the bottom frame, so the collector only has to scan
+// eval_stack[0..eval_sp). All three stacks live on the heap and grow on
+// demand, so recursion depth is bounded by memory and max_call_depth.
+
+typedef struct {
+    ASTNode *node;
+    int state;       // progress through the node
+    int index;       // next child, or the for-loop position
+} EvalTask;
+
+typedef struct {
+    Function *func;  // NULL for the top level
+    int base;        // first slot in eval_stack
+    int task_depth;  // task count above the calling task
+    MemoEntry *memo; // cache entry to fill in on return, if any
+} EvalFrame;
+
+Value *eval_stack = NULL;
+int eval_sp = 0;
+int eval_stack_capacity = 0;
+int eval_base = 0;        // slots of the current frame
+EvalTask *eval_tasks = NULL;
+int eval_task_count = 0;
+int eval_task_capacity = 0;
+EvalFrame *eval_frames = NULL;
+int eval_frame_count = 0;
+int eval_frame_capacity = 0;
+
+// Grows one of the evaluator's (or the VM's) stacks. Running out of
+// memory here is reported like any other overflow rather than crashing.
+void* grow_stack(void *items, int *capacity, size_t item_size, int initial) {
+    int grown = *capacity ? *capacity * 2 : initial;
+    void *moved = realloc(items, item_size * grown);
+    if (!moved) {
+        flush_output();
+        fprintf(stderr, "Error: Stack overflow (out of memory)\n");
+        exit(1);
+    }
+    *capacity = grown;
+    return moved;
+}
+
+void stack_overflow(int line) {
+    flush_output();
+    fprintf(stderr, "Error: Stack overflow: more than %d nested calls (line %d)\n", max_call_depth, line);
+    exit(1);
+}
+
+void eval_push(Value v) {
+    if (eval_sp == eval_stack_capacity) {
+        eval_stack = grow_stack(eval_stack, &eval_stack_capacity, sizeof(Value), 1024);
+    }
+    eval_stack[eval_sp++] = v;
+}
+
+void eval_push_task(ASTNode *node) {
+    if (eval_task_count == eval_task_capacity) {
+        eval_tasks = grow_stack(eval_tasks, &eval_task_capacity, sizeof(EvalTask), 256);
+    }
+    EvalTask *t = &eval_tasks[eval_task_count++];
+    stat_evals[node->type]++;
+    t->node = node;
+    t->state = 0;
+    t->index = 0;
+}
+
+// Depth 0 is the current frame, depth 1 the globals.
+Value* slot_ref(int depth, int slot) {
+    return &eval_stack[(depth ? 0 : eval_base) + slot];
+}
+
+// Literals and variables, which never need a task.
+int eval_leaf(ASTNode *node, Value *out) {
+    if (node->type == NODE_LITERAL) {
+        *out = constants[node->data.literal.constant];
+    } else if (node->type == NODE_IDENTIFIER) {
+        *out = *slot_ref(node->data.identifier.depth, node->data.identifier.slot);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+Value finish_binary(ASTNode *node, Value left, Value right);
+
+// Queues an expression and returns 1 if it became a task. Leaves, and
+// arithmetic or comparisons on two leaves, are evaluated on the spot and
+// return 0, so the caller can carry on with the value already on the
+// stack instead of going round the loop.
+int eval_schedule(ASTNode *node) {
+    Value left, right;
+    if (!node) {
+        eval_push(create_null());
+    } else if (eval_leaf(node, &left)) {
+        stat_evals[node->type]++;
+        eval_push(left);
+    } else if ((node->type == NODE_BINARY_INT || node->type == NODE_BINARY_FLOAT ||
+                node->type == NODE_BINARY_CONCAT || (node->type == NODE_BINARY_OP &&
+                node->data.binary.op != BIN_AND && node->data.binary.op != BIN_OR)) &&
+               eval_leaf(node->data.binary.left, &left) && eval_leaf(node->data.binary.right, &right)) {
+        stat_evals[node->type]++;
+        stat_evals[node->data.binary.left->type]++;
+        stat_evals[node->data.binary.right->type]++;
+        eval_push(finish_binary(node, left, right));
+    } else {
+        eval_push_task(node);
+        return 1;
+    }
+    return 0;
+}
+
+// Schedules the remaining expressions of a list, one per task index.
+int eval_schedule_list(EvalTask *t, ASTNode **nodes, int count) {
+    while (t->index < count) {
+        if (eval_schedule(nodes[t->index++])) return 1;
+    }
+    return 0;
+}
+
+// Turns the `argc` values on top of the stack into a frame for `func`.
+// Extra arguments are dropped, missing ones and locals start as null.
+void enter_frame(Function *func, int base, int argc) {
+    if (argc > func->param_count) eval_sp = base + func->param_count;
+    while (eval_sp < base + func->slot_count) eval_push(create_null());
+    eval_base = base;
+    eval_push_task(func->body);
+}
+
+void push_frame(Function *func, int argc, int line, MemoEntry *memo) {
+    if (max_call_depth && eval_frame_count > max_call_depth) stack_overflow(line);
+    if (profiling) profile_calls[func - funcs]++;
+    if (eval_frame_count == eval_frame_capacity) {
+        eval_frames = grow_stack(eval_frames, &eval_frame_capacity, sizeof(EvalFrame), 64);
+    }
+    EvalFrame *frame = &eval_frames[eval_frame_count++];
+    frame->func = func;
+    frame->base = eval_sp - argc;
+    frame->task_depth = eval_task_count;
+    frame->memo = memo;
+    enter_frame(func, frame->base, argc);
+    if (eval_frame_count > stat_peak_depth) stat_peak_depth = eval_frame_count;
+    if (eval_sp > stat_peak_stack) stat_peak_stack = eval_sp;
+}
+
+// Leaves the current frame with `result` in place of the calling task.
+void pop_frame(Value result) {
+    EvalFrame *frame = &eval_frames[--eval_frame_count];
+    if (frame->memo) memo_store(frame->memo, result);
+    eval_sp = frame->base;
+    eval_task_count = frame->task_depth - 1;
+    eval_base = eval_frames[eval_frame_count - 1].base;
+    eval_push(result);
+}
+
+// `return f(...)` reuses the current frame, so tail recursion runs in
+// constant space. The arguments are on top of the stack. A pending cache
+// entry stays with the frame, since the result is the same.
+void tail_call(Function *func, int argc) {
+    EvalFrame *frame = &eval_frames[eval_frame_count - 1];
+    int count = argc < func->param_count ? argc : func->param_count;
+    memmove(&eval_stack[frame->base], &eval_stack[eval_sp - argc], sizeof(Value) * count);
+    eval_sp = frame->base + count;
+    eval_task_count = frame->task_depth;
+    frame->func = func;
+    if (profiling) profile_calls[func - funcs]++;
+    enter_frame(func, frame->base, count);
+}
+
+// Generic path. After evaluating, the node rewrites itself into a variant
+// specialized for the operand types it saw, unless it has already had to
+// fall back from one.
+Value eval_binary(ASTNode *node, Value left, Value right) {
+    BinaryOp op = node->data.binary.op;
+    if (op == BIN_AND || op == BIN_OR) return create_bool(is_truthy(right));
+    
+    if (!node->data.binary.generic) {
+        if (left.type == VAL_INT && right.type == VAL_INT) {
+            node->type = NODE_BINARY_INT;
+        } else if (left.type == VAL_FLOAT && right.type == VAL_FLOAT) {
+            node->type = NODE_BINARY_FLOAT;
+        } else if (op == BIN_ADD && left.type == VAL_STRING && right.type == VAL_STRING) {
+            node->type = NODE_BINARY_CONCAT;
+        }
+    }
+    return binary_op(op, left, right);
+}
+
+// A specialized node saw operands it was not built for: revert it to the
+// generic form for good.
+Value deoptimize_binary(ASTNode *node, Value left, Value right) {
+    node->type = NODE_BINARY_OP;
+    node->data.binary.generic = 1;
+    return binary_op(node->data.binary.op, left, right);
+}
+
+Value finish_binary(ASTNode *node, Value left, Value right) {
+    switch (node->type) {
+        case NODE_BINARY_INT:
+            if (left.type != VAL_INT || right.type != VAL_INT) return deoptimize_binary(node, left, right);
+            return int_binary(node->data.binary.op, left.data.int_val, right.data.int_val);
+        case NODE_BINARY_FLOAT:
+            if (left.type != VAL_FLOAT || right.type != VAL_FLOAT) return deoptimize_binary(node, left, right);
+            return float_binary(node->data.binary.op, left.data.float_val, right.data.float_val);
+        case NODE_BINARY_CONCAT:
+            if (left.type != VAL_STRING || right.type != VAL_STRING) return deoptimize_binary(node, left, right);
+            return concat_strings(left.data.string_val, right.data.string_val);
+        default:
+            return eval_binary(node, left, right);
+    }
+}
+
+// Whether `continue` can reach the loop whose body this is.
+int continues_loop(ASTNode *node) {
+    if (!node) return 0;
+    switch (node->type) {
+        case NODE_CONTINUE_STMT:
+            return 1;
+        case NODE_BLOCK:
+            for (int i = 0; i < node->data.block.stmt_count; i++) {
+                if (continues_loop(node->data.block.statements[i])) return 1;
+            }
+            return 0;
+        case NODE_IF_STMT:
+            return continues_loop(node->data.if_stmt.then_branch) || continues_loop(node->data.if_stmt.else_branch);
+        default:
+            return 0;
+    }
+}
+
+// Recognizes `while (i < n) { ...; i += k; }`: the condition compares a
+// variable with a literal or another variable, and the body ends by
+// stepping that variable by a constant integer. Such a loop keeps `i` in
+// its slot but compares and steps it natively, without tasks. `continue`
+// would skip the step, so loops that use it are left alone.
+void specialize_loop(ASTNode *node) {
+    ASTNode *cond = node->data.while_stmt.condition;
+    ASTNode *body = node->data.while_stmt.body;
+    node->data.while_stmt.counting = -1;
+    if ((cond->type != NODE_BINARY_OP && cond->type != NODE_BINARY_INT) ||
+        cond->data.binary.op < BIN_GT || cond->data.binary.op > BIN_NEQ || cond->data.binary.op == BIN_EQ ||
+        cond->data.binary.left->type != NODE_IDENTIFIER ||
+        (cond->data.binary.right->type != NODE_IDENTIFIER && cond->data.binary.right->type != NODE_LITERAL) ||
+        body->type != NODE_BLOCK || body->data.block.stmt_count == 0 || continues_loop(body)) {
+        return;
+    }
+
+    ASTNode *var = cond->data.binary.left;
+    ASTNode *step = body->data.block.statements[body->data.block.stmt_count - 1];
+    if (!step || step->type != NODE_ASSIGN ||
+        step->data.binary.left->data.identifier.depth != var->data.identifier.depth ||
+        step->data.binary.left->data.identifier.slot != var->data.identifier.slot) {
+        return;
+    }
+    // i += k, i -= k, or i = i + k
+    ASTNode *amount = step->data.binary.right;
+    BinaryOp op = step->data.binary.op;
+    if (op == BIN_NONE && (amount->type == NODE_BINARY_OP || amount->type == NODE_BINARY_INT) &&
+        (amount->data.binary.op == BIN_ADD || amount->data.binary.op == BIN_SUB) &&
+        amount->data.binary.left->type == NODE_IDENTIFIER &&
+        amount->data.binary.left->data.identifier.depth == var->data.identifier.depth &&
+        amount->data.binary.left->data.identifier.slot == var->data.identifier.slot) {
+        op = amount->data.binary.op;
+        amount = amount->data.binary.right;
+    }
+    if ((op != BIN_ADD && op != BIN_SUB) || amount->type != NODE_LITERAL ||
+        constants[amount->data.literal.constant].type != VAL_INT) {
+        return;
+    }
+    int k = constants[amount->data.literal.constant].data.int_val;
+
+    ASTNode *counted = alloc_node(body->line);
+    counted->type = NODE_BLOCK;
+    counted->data.block.statements = body->data.block.statements;
+    counted->data.block.stmt_count = body->data.block.stmt_count - 1;
+    node->data.while_stmt.counted_body = counted;
+    node->data.while_stmt.step = op == BIN_ADD ? k : (int)(0u - (unsigned)k);
+    node->data.while_stmt.counting = 1;
+}
+
+int compare_ints(BinaryOp op, int a, int b) {
+    switch (op) {
+        case BIN_GT:  return a > b;
+        case BIN_LT:  return a < b;
+        case BIN_GTE: return a >= b;
+        case BIN_LTE: return a <= b;
+        default:      return a != b;
+    }
+}
+
+// Drops the tasks inside the innermost loop, leaving the loop on top.
+// The resolver guarantees there is one in the current frame.
+EvalTask* unwind_to_loop() {
+    while (eval_tasks[eval_task_count - 1].node->type != NODE_WHILE_STMT &&
+           eval_tasks[eval_task_count - 1].node->type != NODE_FOR_STMT) {
+        eval_task_count--;
+    }
+    return &eval_tasks[eval_task_count - 1];
+}
+
+int eval_frame_func(int i) {
+    Function *func = eval_frames[i].func;
+    return func ? (int)(func - funcs) : -1;
+}
+
+void eval_program(ASTNode *program) {
+    for (int i = 0; i < global_scope.slot_count; i++) eval_push(create_null());
+    eval_frames = grow_stack(eval_frames, &eval_frame_capacity, sizeof(EvalFrame), 64);
+    eval_frames[0] = (EvalFrame){ NULL, 0, 0, NULL };
+    eval_frame_count = 1;
+    stat_peak_depth = 1;
+    stat_peak_stack = eval_sp;
+    eval_push_task(program);
+
+    while (eval_task_count > 0) {
+        // Pushing a task may move the task stack, so `t` is not used
+        // once eval_schedule has returned 1
+        EvalTask *t = &eval_tasks[eval_task_count - 1];
+        ASTNode *node = t->node;
+        if (profile_ticks) {
+            profile_walk(eval_frame_count, eval_frame_func);
+            profile_sample(node->line);
+        }
+
+        switch (node->type) {
+
+            case NODE_BREAK_STMT: {
+                EvalTask *loop = unwind_to_loop();
+                if (loop->node->type == NODE_FOR_STMT) eval_sp--;
+                eval_task_count--;
+                break;
+            }
+
+            case NODE_CONTINUE_STMT:
+                // The loop resumes at its next iteration
+                unwind_to_loop();
+                break;
+
+            case NODE_WHILE_STMT:
+                if (!node->data.while_stmt.counting) specialize_loop(node);
+                if (t->state == 2) {
+                    // A counted body finished: step the variable
+                    ASTNode *step = node->data.while_stmt.body->data.block.statements[
+                        node->data.while_stmt.body->data.block.stmt_count - 1];
+                    ASTNode *target = step->data.binary.left;
+                    Value *var = slot_ref(target->data.identifier.depth, target->data.identifier.slot);
+                    t->state = 0;
+                    if (node->data.while_stmt.counting < 0 || var->type != VAL_INT) {
+                        // The body changed the variable's type: back to the general loop
+                        node->data.while_stmt.counting = -1;
+                        eval_push_task(step);
+                        break;
+                    }
+                    var->data.int_val = (int)((unsigned)var->data.int_val + (unsigned)node->data.while_stmt.step);
+                }
+                if (t->state == 0 && node->data.while_stmt.counting > 0) {
+                    ASTNode *cond = node->data.while_stmt.condition;
+                    Value var, bound;
+                    eval_leaf(cond->data.binary.left, &var);
+                    eval_leaf(cond->data.binary.right, &bound);
+                    if (var.type == VAL_INT && bound.type == VAL_INT) {
+                        if (!compare_ints(cond->data.binary.op, var.data.int_val, bound.data.int_val)) {
+                            eval_task_count--;
+                            break;
+                        }
+                        t->state = 2;
+                        eval_push_task(node->data.while_stmt.counted_body);
+                        break;
+                    }
+                    node->data.while_stmt.counting = -1;
+                }
+                if (t->state == 0) {
+                    t->state = 1;
+                    if (eval_schedule(node->data.while_stmt.condition)) break;
+                }
+                if (!is_truthy(eval_stack[--eval_sp])) {
+                    eval_task_count--;
+                    break;
+                }
+                t->state = 0;
+                eval_push_task(node->data.while_stmt.body);
+                break;
+
+            case NODE_PROGRAM:
+            case NODE_BLOCK:
+                if (t->index == node->data.block.stmt_count) {
+                    eval_task_count--;
+                    break;
+                }
+                // Statement boundaries are the collector's safe points
+                if (gc_pending) gc_collect();
+                eval_push_task(node->data.block.statements[t->index++]);
+                break;
+
+            case NODE_FUNC_DECL: {
+                // Redeclaring a function replaces the previous body
+                Function *func = &funcs[node->data.func.func_index];
+                func->name = node->data.func.name;
+                func->param_count = node->data.func.param_count;
+                func->slot_count = node->data.func.slot_count;
+                func->body = node->data.func.body;
+                func->memo = node->data.func.cache;
+                func->defined = 1;
+                eval_task_count--;
+                break;
+            }
+
+            case NODE_VAR_DECL:
+                if (t->state == 0) {
+                    t->state = 1;
+                    if (eval_schedule(node->data.var.init)) break;
+                }
+                eval_stack[eval_base + node->data.var.slot] = eval_stack[--eval_sp];
+                eval_task_count--;
+                break;
+
+            case NODE_ASSIGN: {
+                if (t->state == 0) {
+                    t->state = 1;
+                    if (eval_schedule(node->data.binary.right)) break;
+                }
+                Value val = eval_stack[--eval_sp];
+                BinaryOp op = node->data.binary.op;
+                ASTNode *target = node->data.binary.left;
+                Value *var = slot_ref(target->data.identifier.depth, target->data.identifier.slot);
+
+                if (op != BIN_NONE) {
+                    // x += v is x = x + v
+                    if (var->type == VAL_INT && val.type == VAL_INT) {
+                        val.data.int_val = op == BIN_ADD ? var->data.int_val + val.data.int_val
+                                                         : var->data.int_val - val.data.int_val;
+                    } else {
+                        val = binary_op(op, *var, val);
+                    }
+                }
+
+                *var = val;
+                eval_task_count--;
+                break;
+            }
+
+            case NODE_IF_STMT: {
+                if (t->state == 0) {
+                    t->state = 1;
+                    if (eval_schedule(node->data.if_stmt.condition)) break;
+                }
+                // The chosen branch takes the if's place on the task stack
+                ASTNode *branch = is_truthy(eval_stack[--eval_sp]) ? node->data.if_stmt.then_branch
+                                                                   : node->data.if_stmt.else_branch;
+                eval_task_count--;
+                if (branch) eval_push_task(branch);
+                break;
+            }
+
+            case NODE_FOR_STMT:
+                if (t->state == 0) {
+                    t->state = 1;
+                    if (eval_schedule(node->data.for_stmt.iterable)) break;
+                }
+                // The iterable stays on the value stack for the whole loop
+                if (iter_next(eval_stack[eval_sp - 1], &t->index, &eval_stack[eval_base + node->data.for_stmt.slot])) {
+                    eval_push_task(node->data.for_stmt.body);
+                } else {
+                    eval_sp--;
+                    eval_task_count--;
+                }
+                break;
+
+            case NODE_RETURN_STMT: {
+                ASTNode *value = node->data.return_stmt.value;
+                if (t->state == 0) {
+                    if (eval_frame_count > 1 && value && value->type == NODE_CALL && value->data.call.func_index >= 0) {
+                        t->state = 2;
+                    } else {
+                        t->state = 1;
+                        if (eval_schedule(value)) break;
+                    }
+                }
+                if (t->state == 2) {
+                    int argc = value->data.call.arg_count;
+                    if (eval_schedule_list(t, value->data.call.args, argc)) break;
+                    Function *func = &funcs[value->data.call.func_index];
+                    if (func->defined) {
+                        // A memoized callee is looked up first. On a miss the
+                        // frame records the callee's result, unless it is
+                        // already due to record its own.
+                        EvalFrame *frame = &eval_frames[eval_frame_count - 1];
+                        Value result;
+                        if (func->memo && memo_lookup(func->memo, &eval_stack[eval_sp - argc], argc, &result,
+                                                      frame->memo ? NULL : &frame->memo)) {
+                            pop_frame(result);
+                        } else {
+                            tail_call(func, argc);
+                        }
+                        break;
+                    }
+                    undefined_calls++;
+                    eval_sp -= argc;
+                    eval_push(create_null());
+                }
+                Value result = eval_stack[--eval_sp];
+                if (eval_frame_count == 1) {
+                    // Returning from the top level ends the program
+                    eval_task_count = 0;
+                    break;
+                }
+                pop_frame(result);
+                break;
+            }
+
+            case NODE_EXPR_STMT:
+                if (t->state == 0) {
+                    t->state = 1;
+                    if (eval_schedule(node->data.block.statements[0])) break;
+                }
+                eval_sp--;
+                eval_task_count--;
+                break;
+
+            case NODE_BINARY_OP:
+            case NODE_BINARY_INT:
+            case NODE_BINARY_FLOAT:
+            case NODE_BINARY_CONCAT: {
+                BinaryOp op = node->data.binary.op;
+                if (t->state == 0) {
+                    t->state = 1;
+                    if (eval_schedule(node->data.binary.left)) break;
+                }
+                if (t->state == 1) {
+                    // && and || short-circuit
+                    Value left = eval_stack[eval_sp - 1];
+                    if ((op == BIN_AND && !is_truthy(left)) || (op == BIN_OR && is_truthy(left))) {
+                        eval_stack[eval_sp - 1] = create_bool(op == BIN_OR);
+                        eval_task_count--;
+                        break;
+                    }
+                    t->state = 2;
+                    if (eval_schedule(node->data.binary.right)) break;
+                }
+                Value right = eval_stack[--eval_sp];
+                eval_stack[eval_sp - 1] = finish_binary(node, eval_stack[eval_sp - 1], right);
+                eval_task_count--;
+                break;
+            }
+
+            case NODE_CALL: {
+                int argc = node->data.call.arg_count;
+                if (t->state == 0) {
+                    // Arguments are evaluated left to right onto the stack
+                    if (eval_schedule_list(t, node->data.call.args, argc)) break;
+                    if (node->data.call.func_index < 0) {
+                        Value result = node->data.call.builtin->fn(&eval_stack[eval_sp - argc], argc);
+                        eval_sp -= argc;
+                        eval_push(result);
+                        eval_task_count--;
+                        break;
+                    }
+                    // User-defined functions
+                    Function *func = &funcs[node->data.call.func_index];
+                    if (!func->defined) {
+                        undefined_calls++;
+                        eval_sp -= argc;
+                        eval_push(create_null());
+                        eval_task_count--;
+                        break;
+                    }
+                    MemoEntry *pending = NULL;
+                    if (func->memo) {
+                        Value result;
+                        if (memo_lookup(func->memo, &eval_stack[eval_sp - argc], argc, &result, &pending)) {
+                            eval_sp -= argc;
+                            eval_push(result);
+                            eval_task_count--;
+                            break;
+                        }
+                    }
+                    t->state = 1;
+                    push_frame(func, argc, node->line, pending);
+                    break;
+                }
+                // The body finished without a return statement
+                pop_frame(create_null());
+                break;
+            }
+
+            case NODE_LITERAL:
+            case NODE_IDENTIFIER: {
+                Value v;
+                eval_leaf(node, &v);
+                eval_task_count--;
+                eval_push(v);
+                break;
+            }
+
+            case NODE_ARRAY_LIT: {
+                int count = node->data.array.element_count;
+                if (eval_schedule_list(t, node->data.array.elements, count)) break;
+                Value array = create_array_from(&eval_stack[eval_sp - count], count);
+                eval_sp -= count;
+                eval_push(array);
+                eval_task_count--;
+                break;
+            }
+
+            case NODE_INDEX: {
+                if (t->state == 0) {
+                    t->state = 1;
+                    eval_push(*slot_ref(node->data.index.depth, node->data.index.slot));
+                    if (eval_schedule(node->data.index.index)) break;
+                }
+                Value idx = eval_stack[--eval_sp];
+                eval_stack[eval_sp - 1] = index_value(eval_stack[eval_sp - 1], idx);
+                eval_task_count--;
+                break;
+            }
+
+            default:
+                eval_task_count--;
+                eval_push(create_null());
+                break;
+        }
+    }
+}
+
+// ============= BYTECODE VM =============
+// Alternative engine selected with --engine=vm. The resolved AST is
+// compiled into flat instruction streams and run on a value stack with
+// threaded (computed-goto) dispatch where the compiler supports it.
+// Globals live at the bottom of the stack as the top-level frame.
+
+#define OPCODES(X) \
+    X(OP_CONST) X(OP_NULL) X(OP_POP) \
+    X(OP_GET_LOCAL) X(OP_SET_LOCAL) X(OP_GET_GLOBAL) X(OP_SET_GLOBAL) \
+    X(OP_ADD) X(OP_SUB) X(OP_MUL) X(OP_DIV) X(OP_MOD) \
+    X(OP_GT) X(OP_LT) X(OP_GTE) X(OP_LTE) X(OP_EQ) X(OP_NEQ) \
+    X(OP_TO_BOOL) \
+    X(OP_JUMP) X(OP_JUMP_IF_FALSE) \
+    X(OP_JUMP_IF_FALSE_OR_POP) X(OP_JUMP_IF_TRUE_OR_POP) \
+    X(OP_ARRAY) X(OP_INDEX) X(OP_FOR_PREP) X(OP_FOR_ITER) \
+    X(OP_DEFINE_FUNC) X(OP_CALL) X(OP_TAIL_CALL) X(OP_CALL_BUILTIN) X(OP_RETURN) X(OP_HALT)
+
+#define OPCODE_ENUM(op) op,
+typedef enum { OPCODES(OPCODE_ENUM) OP_COUNT } Opcode;
+
+#if defined(__GNUC__)
+#define VM_THREADED 1
+#endif
+
+typedef struct {
+    int *code;       // opcodes followed by their operands
+    int *lines;      // source line per code word
+    int count;
+    int capacity;
+} Chunk;
+
+typedef struct {
+    Chunk chunk;
+    int param_count;
+    int slot_count;  // resolver slots plus loop temporaries
+    int max_stack;   // deepest expression stack above the slots
+    MemoCache *memo; // result cache, NULL unless memoized
+    int func_index;  // -1 for the top level
+} Proto;
+
+typedef struct {
+    Proto *proto;
+    int *ip;
+    Value *slots;
+    int base;        // offset of slots in vm_stack, for rebasing
+    MemoEntry *memo; // cache entry to fill in on return, if any
+} CallFrame;
+
+typedef struct VMLoop {
+    int start;
+    int *breaks;
+    int break_count;
+    int break_capacity;
+    struct VMLoop *enclosing;
+} VMLoop;
+
+typedef struct {
+    Proto *proto;
+    int depth;       // current expression stack depth
+    VMLoop *loop;
+    int function;    // inside a function body, where tail calls apply
+} Compiler;
+
+Proto **vm_protos = NULL;    // one per compiled function declaration
+int vm_proto_count = 0;
+int vm_proto_capacity = 0;
+Proto **vm_funcs = NULL;     // current binding per function index
+
+Value *vm_stack = NULL;
+int vm_stack_capacity = 0;
+int vm_sp = 0;            // stack height at the last safe point
+CallFrame *vm_frames = NULL;
+int vm_frame_count = 0;
+int vm_frame_capacity = 0;
+
+void emit(Compiler *c, int word, int line) {
+    Chunk *chunk = &c->proto->chunk;
+    if (chunk->count == chunk->capacity) {
+        chunk->capacity = chunk->capacity ? chunk->capacity * 2 : 64;
+        chunk->code = realloc(chunk->code, sizeof(int) * chunk->capacity);
+        chunk->lines = realloc(chunk->lines, sizeof(int) * chunk->capacity);
+    }
+    chunk->lines[chunk->count] = line;
+    chunk->code[chunk->count++] = word;
+}
+
+// Tracks the expression stack so each frame can reserve enough room.
+void stack_effect(Compiler *c, int delta) {
+    c->depth += delta;
+    if (c->depth > c->proto->max_stack) c->proto->max_stack = c->depth;
+}
+
+void emit_op(Compiler *c, Opcode op, int delta, int line) {
+    emit(c, op, line);
+    stack_effect(c, delta);
+}
+
+int emit_jump(Compiler *c, Opcode op, int delta, int line) {
+    emit_op(c, op, delta, line);
+    emit(c, -1, line);
+    return c->proto->chunk.count - 1;
+}
+
+void patch_jump(Compiler *c, int at) {
+    c->proto->chunk.code[at] = c->proto->chunk.count;
+}
+
+int add_proto(Proto *proto) {
+    if (vm_proto_count == vm_proto_capacity) {
+        vm_proto_capacity = vm_proto_capacity ? vm_proto_capacity * 2 : 16;
+        vm_protos = realloc(vm_protos, sizeof(Proto*) * vm_proto_capacity);
+    }
+    vm_protos[vm_proto_count] = proto;
+    return vm_proto_count++;
+}
+
+void compile_node(Compiler *c, ASTNode *node);
+
+void compile_get(Compiler *c, int depth, int slot, int line) {
+    emit_op(c, depth ? OP_GET_GLOBAL : OP_GET_LOCAL, 1, line);
+    emit(c, slot, line);
+}
+
+void compile_set(Compiler *c, int depth, int slot, int line) {
+    emit_op(c, depth ? OP_SET_GLOBAL : OP_SET_LOCAL, -1, line);
+    emit(c, slot, line);
+}
+
+void compile_loop_body(Compiler *c, VMLoop *loop, ASTNode *body) {
+    loop->enclosing = c->loop;
+    c->loop = loop;
+    compile_node(c, body);
+    c->loop = loop->enclosing;
+}
+
+void patch_breaks(Compiler *c, VMLoop *loop) {
+    for (int i = 0; i < loop->break_count; i++) patch_jump(c, loop->breaks[i]);
+    free(loop->breaks);
+}
+
+Proto* compile_function(ASTNode *node) {
+    Proto *proto = calloc(1, sizeof(Proto));
+    proto->param_count = node->data.func.param_count;
+    proto->slot_count = node->data.func.slot_count;
+    proto->memo = node->data.func.cache;
+    proto->func_index = node->data.func.func_index;
+    Compiler c = { proto, 0, NULL, 1 };
+    compile_node(&c, node->data.func.body);
+    // Falling off the end returns null
+    emit_op(&c, OP_NULL, 1, node->line);
+    emit_op(&c, OP_RETURN, -1, node->line);
+    return proto;
+}
+
+void compile_node(Compiler *c, ASTNode *node) {
+    if (!node) return;
+    int line = node->line;
+
+    switch (node->type) {
+        case NODE_PROGRAM:
+        case NODE_BLOCK:
+            for (int i = 0; i < node->data.block.stmt_count; i++) {
+                compile_node(c, node->data.block.statements[i]);
+            }
+            break;
+
+        case NODE_FUNC_DECL: {
+            int proto = add_proto(compile_function(node));
+            emit_op(c, OP_DEFINE_FUNC, 0, line);
+            emit(c, node->data.func.func_index, line);
+            emit(c, proto, line);
+            break;
+        }
+
+        case NODE_VAR_DECL:
+            compile_node(c, node->data.var.init);
+            compile_set(c, 0, node->data.var.slot, line);
+            break;
+
+        case NODE_ASSIGN: {
+            ASTNode *target = node->data.binary.left;
+            BinaryOp op = node->data.binary.op;
+            if (op != BIN_NONE) compile_get(c, target->data.identifier.depth, target->data.identifier.slot, line);
+            compile_node(c, node->data.binary.right);
+            if (op != BIN_NONE) emit_op(c, OP_ADD + op, -1, line);
+            compile_set(c, target->data.identifier.depth, target->data.identifier.slot, line);
+            break;
+        }
+
+        case NODE_IF_STMT: {
+            compile_node(c, node->data.if_stmt.condition);
+            int else_jump = emit_jump(c, OP_JUMP_IF_FALSE, -1, line);
+            compile_node(c, node->data.if_stmt.then_branch);
+            if (node->data.if_stmt.else_branch) {
+                int end_jump = emit_jump(c, OP_JUMP, 0, line);
+                patch_jump(c, else_jump);
+                compile_node(c, node->data.if_stmt.else_branch);
+                patch_jump(c, end_jump);
+            } else {
+                patch_jump(c, else_jump);
+            }
+            break;
+        }
+
+        case NODE_WHILE_STMT: {
+            VMLoop loop = {0};
+            loop.start = c->proto->chunk.count;
+            compile_node(c, node->data.while_stmt.condition);
+            int exit_jump = emit_jump(c, OP_JUMP_IF_FALSE, -1, line);
+            compile_loop_body(c, &loop, node->data.while_stmt.body);
+            emit_op(c, OP_JUMP, 0, line);
+            emit(c, loop.start, line);
+            patch_jump(c, exit_jump);
+            patch_breaks(c, &loop);
+            break;
+        }
+
+        case NODE_FOR_STMT: {
+            // Two hidden slots hold the iterable and the position
+            int iter_slot = c->proto->slot_count;
+            c->proto->slot_count += 2;
+            compile_node(c, node->data.for_stmt.iterable);
+            emit_op(c, OP_FOR_PREP, -1, line);
+            emit(c, iter_slot, line);
+
+            VMLoop loop = {0};
+            loop.start = c->proto->chunk.count;
+            emit_op(c, OP_FOR_ITER, 0, line);
+            emit(c, iter_slot, line);
+            emit(c, node->data.for_stmt.slot, line);
+            emit(c, -1, line);
+            int exit_jump = c->proto->chunk.count - 1;
+            compile_loop_body(c, &loop, node->data.for_stmt.body);
+            emit_op(c, OP_JUMP, 0, line);
+            emit(c, loop.start, line);
+            patch_jump(c, exit_jump);
+            patch_breaks(c, &loop);
+            break;
+        }
+
+        case NODE_BREAK_STMT: {
+            VMLoop *loop = c->loop;
+            if (loop->break_count == loop->break_capacity) {
+                loop->break_capacity = loop->break_capacity ? loop->break_capacity * 2 : 4;
+                loop->breaks = realloc(loop->breaks, sizeof(int) * loop->break_capacity);
+            }
+            loop->breaks[loop->break_count++] = emit_jump(c, OP_JUMP, 0, line);
+            break;
+        }
+
+        case NODE_CONTINUE_STMT:
+            emit_op(c, OP_JUMP, 0, line);
+            emit(c, c->loop->start, line);
+            break;
+
+        case NODE_RETURN_STMT: {
+            ASTNode *value = node->data.return_stmt.value;
+            if (c->function && value && value->type == NODE_CALL && value->data.call.func_index >= 0) {
+                // Replaces the current frame. The OP_RETURN after it is
+                // only reached if the function was never defined or its
+                // result was cached.
+                int argc = value->data.call.arg_count;
+                for (int i = 0; i < argc; i++) compile_node(c, value->data.call.args[i]);
+                emit_op(c, OP_TAIL_CALL, 1 - argc, line);
+                emit(c, value->data.call.func_index, line);
+                emit(c, argc, line);
+            } else {
+                compile_node(c, value);
+            }
+            emit_op(c, OP_RETURN, -1, line);
+            break;
+        }
+
+        case NODE_EXPR_STMT:
+            compile_node(c, node->data.block.statements[0]);
+            emit_op(c, OP_POP, -1, line);
+            break;
+
+        case NODE_BINARY_OP: {
+            BinaryOp op = node->data.binary.op;
+            compile_node(c, node->data.binary.left);
+            if (op == BIN_AND || op == BIN_OR) {
+                // Short-circuit: the left value decides unless it passes
+                int end_jump = emit_jump(c, op == BIN_AND ? OP_JUMP_IF_FALSE_OR_POP : OP_JUMP_IF_TRUE_OR_POP, -1, line);
+                compile_node(c, node->data.binary.right);
+                patch_jump(c, end_jump);
+                emit_op(c, OP_TO_BOOL, 0, line);
+                break;
+            }
+            compile_node(c, node->data.binary.right);
+            emit_op(c, OP_ADD + op, -1, line);
+            break;
+        }
+
+        case NODE_CALL: {
+            int argc = node->data.call.arg_count;
+            for (int i = 0; i < argc; i++) compile_node(c, node->data.call.args[i]);
+            if (node->data.call.func_index < 0) {
+                emit_op(c, OP_CALL_BUILTIN, 1 - argc, line);
+                emit(c, (int)(node->data.call.builtin - builtins), line);
+            } else {
+                emit_op(c, OP_CALL, 1 - argc, line);
+                emit(c, node->data.call.func_index, line);
+            }
+            emit(c, argc, line);
+            break;
+        }
+
+        case NODE_LITERAL:
+            emit_op(c, OP_CONST, 1, line);
+            emit(c, node->data.literal.constant, line);
+            break;
+
+        case NODE_IDENTIFIER:
+            compile_get(c, node->data.identifier.depth, node->data.identifier.slot, line);
+            break;
+
+        case NODE_ARRAY_LIT: {
+            int count = node->data.array.element_count;
+            for (int i = 0; i < count; i++) compile_node(c, node->data.array.elements[i]);
+            emit_op(c, OP_ARRAY, 1 - count, line);
+            emit(c, count, line);
+            break;
+        }
+
+        case NODE_INDEX:
+            compile_get(c, node->data.index.depth, node->data.index.slot, line);
+            compile_node(c, node->data.index.index);
+            emit_op(c, OP_INDEX, -1, line);
+            break;
+
+        default:
+            break;
+    }
+}
+
+Proto* compile_program(ASTNode *program) {
+    Proto *proto = calloc(1, sizeof(Proto));
+    proto->slot_count = global_scope.slot_count;
+    proto->func_index = -1;
+    Compiler c = { proto, 0, NULL, 0 };
+    compile_node(&c, program);
+    emit_op(&c, OP_HALT, 0, program->line);
+    return proto;
+}
+
+// Makes room for `needed` values above `top`, rebasing live frames if the
+// stack moves. Returns the (possibly moved) top.
+Value* vm_reserve(Value *top, int needed) {
+    int used = (int)(top - vm_stack);
+    if (used + needed <= vm_stack_capacity) return top;
+    int capacity = vm_stack_capacity ? vm_stack_capacity : 1024;
+    while (capacity < used + needed) capacity *= 2;
+    Value *moved = realloc(vm_stack, sizeof(Value) * capacity);
+    if (!moved) {
+        flush_output();
+        fprintf(stderr, "Error: Stack overflow (out of memory)\n");
+        exit(1);
+    }
+    vm_stack = moved;
+    vm_stack_capacity = capacity;
+    for (int i = 0; i < vm_frame_count; i++) {
+        vm_frames[i].slots = vm_stack + vm_frames[i].base;
+    }
+    return vm_stack + used;
+}
+
+CallFrame* vm_push_frame(Proto *proto, Value *slots) {
+    if (vm_frame_count == vm_frame_capacity) {
+        vm_frames = grow_stack(vm_frames, &vm_frame_capacity, sizeof(CallFrame), 64);
+    }
+    CallFrame *frame = &vm_frames[vm_frame_count++];
+    frame->proto = proto;
+    frame->ip = proto->chunk.code;
+    frame->slots = slots;
+    frame->base = (int)(slots - vm_stack);
+    frame->memo = NULL;
+    if (vm_frame_count > stat_peak_depth) stat_peak_depth = vm_frame_count;
+    if (frame->base + proto->slot_count > stat_peak_stack) stat_peak_stack = frame->base + proto->slot_count;
+    return frame;
+}
+
+int vm_frame_func(int i) {
+    return vm_frames[i].proto->func_index;
+}
+
+void vm_run(Proto *main_proto) {
+    vm_funcs = calloc(func_count + 1, sizeof(Proto*));
+    Value *sp = vm_reserve(vm_stack, main_proto->slot_count + main_proto->max_stack);
+    CallFrame *frame = vm_push_frame(main_proto, vm_stack);
+    for (int i = 0; i < main_proto->slot_count; i++) *sp++ = create_null();
+
+    int *ip = frame->ip;
+    Value *slots = frame->slots;
+
+#ifdef VM_THREADED
+#define OPCODE_LABEL(op) &&L_##op,
+    static void *dispatch[] = { OPCODES(OPCODE_LABEL) };
+#define VM_CASE(op) L_##op:
+#define VM_NEXT() goto *dispatch[*ip++]
+    VM_NEXT();
+#else
+#define VM_CASE(op) case op:
+#define VM_NEXT() continue
+    for (;;) switch (*ip++) {
+#endif
+
+    VM_CASE(OP_CONST)
+        *sp++ = constants[*ip++];
+        VM_NEXT();
+
+    VM_CASE(OP_NULL)
+        *sp++ = create_null();
+        VM_NEXT();
+
+    VM_CASE(OP_POP)
+        sp--;
+        VM_NEXT();
+
+    VM_CASE(OP_GET_LOCAL)
+        *sp++ = slots[*ip++];
+        VM_NEXT();
+
+    VM_CASE(OP_SET_LOCAL)
+        slots[*ip++] = *--sp;
+        VM_NEXT();
+
+    VM_CASE(OP_GET_GLOBAL)
+        *sp++ = vm_stack[*ip++];
+        VM_NEXT();
+
+    VM_CASE(OP_SET_GLOBAL)
+        vm_stack[*ip++] = *--sp;
+        VM_NEXT();
+
+// Jumps (every loop has one) and calls are the VM's safe points; all
+// live values are on the stack below sp there. The profiler samples
+// there too.
+#define VM_SAFEPOINT() \
+    if (gc_pending) { vm_sp = (int)(sp - vm_stack); gc_collect(); } \
+    if (profile_ticks) { \
+        profile_walk(vm_frame_count, vm_frame_func); \
+        profile_sample(frame->proto->chunk.lines[ip - 1 - frame->proto->chunk.code]); \
+    }
+
+#define VM_INT_BINARY(op, bin, make, expr) \
+    VM_CASE(op) { \
+        Value b = *--sp; \
+        Value a = sp[-1]; \
+        if (a.type == VAL_INT && b.type == VAL_INT) sp[-1] = make(expr); \
+        else sp[-1] = binary_op(bin, a, b); \
+        VM_NEXT(); \
+    }
+
+    VM_INT_BINARY(OP_ADD, BIN_ADD, create_int, a.data.int_val + b.data.int_val)
+    VM_INT_BINARY(OP_SUB, BIN_SUB, create_int, a.data.int_val - b.data.int_val)
+    VM_INT_BINARY(OP_MUL, BIN_MUL, create_int, a.data.int_val * b.data.int_val)
+    VM_INT_BINARY(OP_DIV, BIN_DIV, create_int, a.data.int_val / b.data.int_val)
+    VM_INT_BINARY(OP_MOD, BIN_MOD, create_int, a.data.int_val % b.data.int_val)
+    VM_INT_BINARY(OP_GT, BIN_GT, create_bool, a.data.int_val > b.data.int_val)
+    VM_INT_BINARY(OP_LT, BIN_LT, create_bool, a.data.int_val < b.data.int_val)
+    VM_INT_BINARY(OP_GTE, BIN_GTE, create_bool, a.data.int_val >= b.data.int_val)
+    VM_INT_BINARY(OP_LTE, BIN_LTE, create_bool, a.data.int_val <= b.data.int_val)
+    VM_INT_BINARY(OP_EQ, BIN_EQ, create_bool, a.data.int_val == b.data.int_val)
+    VM_INT_BINARY(OP_NEQ, BIN_NEQ, create_bool, a.data.int_val != b.data.int_val)
+
+    VM_CASE(OP_TO_BOOL)
+        sp[-1] = create_bool(is_truthy(sp[-1]));
+        VM_NEXT();
+
+    VM_CASE(OP_JUMP)
+        VM_SAFEPOINT();
+        ip = frame->proto->chunk.code + *ip;
+        VM_NEXT();
+
+    VM_CASE(OP_JUMP_IF_FALSE)
+        if (is_truthy(*--sp)) ip++;
+        else ip = frame->proto->chunk.code + *ip;
+        VM_NEXT();
+
+    VM_CASE(OP_JUMP_IF_FALSE_OR_POP)
+        if (is_truthy(sp[-1])) { sp--; ip++; }
+        else ip = frame->proto->chunk.code + *ip;
+        VM_NEXT();
+
+    VM_CASE(OP_JUMP_IF_TRUE_OR_POP)
+        if (!is_truthy(sp[-1])) { sp--; ip++; }
+        else ip = frame->proto->chunk.code + *ip;
+        VM_NEXT();
+
+    VM_CASE(OP_ARRAY) {
+        int count = *ip++;
+        sp -= count;
+        *sp = create_array_from(sp, count);
+        sp++;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_INDEX) {
+        Value idx = *--sp;
+        sp[-1] = index_value(sp[-1], idx);
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_FOR_PREP) {
+        int iter_slot = *ip++;
+        slots[iter_slot] = *--sp;
+        slots[iter_slot + 1] = create_int(0);
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_FOR_ITER) {
+        if (!iter_next(slots[ip[0]], &slots[ip[0] + 1].data.int_val, &slots[ip[1]])) {
+            ip = frame->proto->chunk.code + ip[2];
+            VM_NEXT();
+        }
+        ip += 3;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_DEFINE_FUNC)
+        vm_funcs[ip[0]] = vm_protos[ip[1]];
+        ip += 2;
+        VM_NEXT();
+
+    VM_CASE(OP_CALL) {
+        VM_SAFEPOINT();
+        Proto *callee = vm_funcs[ip[0]];
+        int argc = ip[1];
+        ip += 2;
+        if (!callee) {
+            undefined_calls++;
+            sp -= argc;
+            *sp++ = create_null();
+            VM_NEXT();
+        }
+        MemoEntry *pending = NULL;
+        if (callee->memo) {
+            Value result;
+            if (memo_lookup(callee->memo, sp - argc, argc, &result, &pending)) {
+                sp -= argc;
+                *sp++ = result;
+                VM_NEXT();
+            }
+        }
+        if (max_call_depth && vm_frame_count > max_call_depth) {
+            stack_overflow(frame->proto->chunk.lines[ip - 1 - frame->proto->chunk.code]);
+        }
+        frame->ip = ip;
+        sp = vm_reserve(sp, callee->slot_count + callee->max_stack);
+        slots = sp - argc;
+        // Extra arguments are dropped, missing ones and locals start as null
+        if (argc > callee->param_count) sp = slots + callee->param_count;
+        while (sp < slots + callee->slot_count) *sp++ = create_null();
+        frame = vm_push_frame(callee, slots);
+        frame->memo = pending;
+        if (profiling) profile_calls[callee->func_index]++;
+        ip = frame->ip;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_TAIL_CALL) {
+        VM_SAFEPOINT();
+        Proto *callee = vm_funcs[ip[0]];
+        int argc = ip[1];
+        ip += 2;
+        if (!callee) {
+            undefined_calls++;
+            sp -= argc;
+            *sp++ = create_null();
+            VM_NEXT();
+        }
+        if (callee->memo) {
+            // As in the tree-walker: a hit is returned by the OP_RETURN
+            // that follows, a miss may be recorded by this frame
+            Value result;
+            if (memo_lookup(callee->memo, sp - argc, argc, &result, frame->memo ? NULL : &frame->memo)) {
+                sp -= argc;
+                *sp++ = result;
+                VM_NEXT();
+            }
+        }
+        // The arguments move down over the caller's slots
+        sp = vm_reserve(sp, callee->slot_count + callee->max_stack);
+        slots = frame->slots;
+        int count = argc < callee->param_count ? argc : callee->param_count;
+        memmove(slots, sp - argc, sizeof(Value) * count);
+        sp = slots + count;
+        while (sp < slots + callee->slot_count) *sp++ = create_null();
+        frame->proto = callee;
+        if (profiling) profile_calls[callee->func_index]++;
+        ip = callee->chunk.code;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_CALL_BUILTIN) {
+        int argc = ip[1];
+        Value result = builtins[ip[0]].fn(sp - argc, argc);
+        ip += 2;
+        sp -= argc;
+        *sp++ = result;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_RETURN) {
+        Value result = *--sp;
+        if (vm_frame_count == 1) goto done;
+        if (frame->memo) memo_store(frame->memo, result);
+        sp = frame->slots;
+        *sp++ = result;
+        vm_frame_count--;
+        frame = &vm_frames[vm_frame_count - 1];
+        ip = frame->ip;
+        slots = frame->slots;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_HALT)
+        goto done;
+
+#ifndef VM_THREADED
+    }
+#endif
+
+done:
+    vm_frame_count = 0;
+    vm_sp = 0;
+#undef VM_SAFEPOINT
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_INT_BINARY
+}
+
+// ============= GARBAGE COLLECTOR =============
+// Stop-the-world mark-sweep over strings and arrays. Roots are the
+// constant pool, the two engines' value stacks, which hold the globals,
+// every active frame and all intermediate values, and the memo caches.
+
+Obj **gc_gray = NULL;
+int gc_gray_count = 0;
+int gc_gray_capacity = 0;
+
+void gc_mark_value(Value v) {
+    if (!is_object(v)) return;
+    Obj *obj = v.type == VAL_STRING ? &v.data.string_val->obj :
+               v.type == VAL_ARRAY ? &v.data.array_val->obj : &v.data.iter_val->obj;
+    if (obj->marked) return;
+    obj->marked = 1;
+    if (obj->type == OBJ_STRING) {
+        if (v.data.string_val->buf) v.data.string_val->buf->obj.marked = 1;
+        return;
+    }
+    if (obj->type != OBJ_ARRAY || v.data.array_val->kind != ARRAY_VALUE) return;
+    if (gc_gray_count == gc_gray_capacity) {
+        gc_gray_capacity = gc_gray_capacity ? gc_gray_capacity * 2 : 256;
+        gc_gray = realloc(gc_gray, sizeof(Obj*) * gc_gray_capacity);
+    }
+    gc_gray[gc_gray_count++] = obj;
+}
+
+void gc_mark_slots(Value *slots, int count) {
+    for (int i = 0; i < count; i++) gc_mark_value(slots[i]);
+}
+
+// Cached results and keys, including the keys of calls still running.
+void gc_mark_memo() {
+    for (int i = 0; i < memo_cache_count; i++) {
+        for (MemoEntry *entry = memo_caches[i]->newest; entry; entry = entry->older) {
+            gc_mark_slots(entry->args, memo_caches[i]->param_count);
+            gc_mark_value(entry->result);
+        }
+    }
+    for (int i = 0; i < eval_frame_count; i++) {
+        MemoEntry *entry = eval_frames[i].memo;
+        if (entry) gc_mark_slots(entry->args, entry->cache->param_count);
+    }
+    for (int i = 0; i < vm_frame_count; i++) {
+        MemoEntry *entry = vm_frames[i].memo;
+        if (entry) gc_mark_slots(entry->args, entry->cache->param_count);
+    }
+}
+
+void gc_free_object(Obj *obj) {
+    free(obj);
+}
+
+void gc_collect() {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    // Mark
+    gc_mark_slots(constants, constant_count);
+    gc_mark_slots(eval_stack, eval_sp);
+    gc_mark_memo();
+    gc_mark_slots(vm_stack, vm_sp);
+    while (gc_gray_count > 0) {
+        ObjArray *arr = (ObjArray*)gc_gray[--gc_gray_count];
+        if (arr->kind == ARRAY_VALUE) gc_mark_slots(arr->data.values, arr->count);
+    }
+    
+    // Sweep
+    Obj **link = &gc_objects;
+    while (*link) {
+        Obj *obj = *link;
+        if (obj->marked) {
+            obj->marked = 0;
+            link = &obj->next;
+        } else {
+            *link = obj->next;
+            gc_bytes -= obj->size;
+            gc_total_freed += obj->size;
+            gc_free_object(obj);
+        }
+    }
+    
+    if (gc_max_heap && gc_bytes > gc_max_heap) {
+        flush_output();
+        fprintf(stderr, "Error: Heap limit of %zu bytes exceeded (%zu bytes live)\n",
+                gc_max_heap, gc_bytes);
+        exit(1);
+    }
+    gc_next_collection = gc_bytes * 2 > GC_MIN_THRESHOLD ? gc_bytes * 2 : GC_MIN_THRESHOLD;
+    if (gc_max_heap && gc_next_collection > gc_max_heap) gc_next_collection = gc_max_heap;
+    gc_pending = 0;
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    gc_collections++;
+    gc_pause_ms += (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+void gc_print_stats() {
+    fprintf(stderr, "GC collections:   %d\n", gc_collections);
+    fprintf(stderr, "GC allocated:     %zu bytes in %zu objects\n", gc_total_allocated, gc_allocations);
+    fprintf(stderr, "GC freed:         %zu bytes\n", gc_total_freed);
+    fprintf(stderr, "GC live at exit:  %zu bytes\n", gc_bytes);
+    fprintf(stderr, "GC peak heap:     %zu bytes\n", gc_peak);
+    fprintf(stderr, "GC total pause:   %.3f ms\n", gc_pause_ms);
+}
+
+// ============= STATISTICS =============
+// --stats prints the counters kept in GLOBAL STATE to stderr when the
+// program exits, as text or (--stats=json) as one JSON object. AST nodes
+// are counted by type in the final tree, after optimization and any
+// runtime specialization.
+
+int stats_format = 0;            // 1 text, 2 JSON
+ASTNode *stats_program = NULL;
+
+const char *node_type_names[NODE_TYPE_COUNT] = {
+    "program", "func_decl", "var_decl", "if", "for", "while",
+    "return", "expr_stmt", "block", "break", "continue",
+    "binary", "unary", "assign", "call", "literal", "identifier",
+    "array", "index", "binary_int", "binary_float", "binary_concat"
+};
+
+const char *object_type_names[OBJ_TYPE_COUNT] = { "string", "array", "buffer", "iterator" };
+
+void count_nodes(ASTNode *node, long *counts) {
+    if (!node) return;
+    counts[node->type]++;
+    switch (node->type) {
+        case NODE_PROGRAM:
+        case NODE_BLOCK:
+        case NODE_EXPR_STMT:
+            for (int i = 0; i < node->data.block.stmt_count; i++) count_nodes(node->data.block.statements[i], counts);
+            break;
+        case NODE_FUNC_DECL:
+            count_nodes(node->data.func.body, counts);
+            break;
+        case NODE_VAR_DECL:
+            count_nodes(node->data.var.init, counts);
+            break;
+        case NODE_IF_STMT:
+            count_nodes(node->data.if_stmt.condition, counts);
+            count_nodes(node->data.if_stmt.then_branch, counts);
+            count_nodes(node->data.if_stmt.else_branch, counts);
+            break;
+        case NODE_FOR_STMT:
+            count_nodes(node->data.for_stmt.iterable, counts);
+            count_nodes(node->data.for_stmt.body, counts);
+            break;
+        case NODE_WHILE_STMT:
+            count_nodes(node->data.while_stmt.condition, counts);
+            count_nodes(node->data.while_stmt.body, counts);
+            break;
+        case NODE_RETURN_STMT:
+            count_nodes(node->data.return_stmt.value, counts);
+            break;
+        case NODE_BINARY_OP:
+        case NODE_BINARY_INT:
+        case NODE_BINARY_FLOAT:
+        case NODE_BINARY_CONCAT:
+        case NODE_ASSIGN:
+            count_nodes(node->data.binary.left, counts);
+            count_nodes(node->data.binary.right, counts);
+            break;
+        case NODE_CALL:
+            for (int i = 0; i < node->data.call.arg_count; i++) count_nodes(node->data.call.args[i], counts);
+            break;
+        case NODE_ARRAY_LIT:
+            for (int i = 0; i < node->data.array.element_count; i++) count_nodes(node->data.array.elements[i], counts);
+            break;
+        case NODE_INDEX:
+            count_nodes(node->data.index.index, counts);
+            break;
+        default:
+            break;
+    }
 }
 
-Variable* find_var(Environment *env, const char *name) {
-    for (int i = 0; i < env->var_count; i++) {
-        if (strcmp(env->vars[i].name, name) == 0) {
-            return &env->vars[i];
-        }
+// Prints the non-zero entries of a per-type table.
+void print_counts(const char *title, const char **names, long *counts, int n, int json) {
+    int first = 1;
+    if (json) fprintf(stderr, ", \"%s\": {", title);
+    for (int i = 0; i < n; i++) {
+        if (!counts[i]) continue;
+        if (json) fprintf(stderr, "%s\"%s\": %ld", first ? "" : ", ", names[i], counts[i]);
+        else fprintf(stderr, "%s    %-22s %ld\n", first ? title : "", names[i], counts[i]);
+        first = 0;
     }
-    return NULL;
+    if (json) fprintf(stderr, "}");
+}
+
+// A --serve request counts from zero rather than from the server's state.
+void reset_counters() {
+    stat_tokens = 0;
+    memset(stat_evals, 0, sizeof(stat_evals));
+    stat_symbol_lookups = stat_symbol_compares = 0;
+    stat_scope_lookups = stat_scope_compares = 0;
+    stat_func_lookups = stat_func_compares = 0;
+    memset(stat_objects, 0, sizeof(stat_objects));
+    memset(stat_object_bytes, 0, sizeof(stat_object_bytes));
+    stat_peak_stack = stat_peak_depth = stat_largest_array = 0;
+    ast_node_count = 0;
+    gc_allocations = gc_total_allocated = gc_total_freed = 0;
+    gc_peak = gc_bytes;
+    gc_collections = 0;
+    gc_pause_ms = 0;
+}
+
+void print_stats() {
+    flush_output();
+    long nodes[NODE_TYPE_COUNT] = {0};
+    count_nodes(stats_program, nodes);
+
+    if (stats_format == 2) {
+        fprintf(stderr, "{\"tokens\": %ld, \"ast_nodes_allocated\": %ld", stat_tokens, ast_node_count);
+        print_counts("ast_nodes", node_type_names, nodes, NODE_TYPE_COUNT, 1);
+        print_counts("evaluations", node_type_names, stat_evals, NODE_TYPE_COUNT, 1);
+        fprintf(stderr, ", \"symbol_lookups\": %ld, \"symbol_comparisons\": %ld, "
+                "\"variable_lookups\": %ld, \"variable_comparisons\": %ld, "
+                "\"function_lookups\": %ld, \"function_comparisons\": %ld",
+                stat_symbol_lookups, stat_symbol_compares, stat_scope_lookups, stat_scope_compares,
+                stat_func_lookups, stat_func_compares);
+        print_counts("objects", object_type_names, stat_objects, OBJ_TYPE_COUNT, 1);
+        print_counts("object_bytes", object_type_names, stat_object_bytes, OBJ_TYPE_COUNT, 1);
+        fprintf(stderr, ", \"peak_stack_slots\": %ld, \"max_call_depth\": %ld, \"largest_array\": %ld}\n",
+                stat_peak_stack, stat_peak_depth, stat_largest_array);
+        return;
+    }
+
+    fprintf(stderr, "Tokens produced:          %ld\n", stat_tokens);
+    fprintf(stderr, "AST nodes allocated:      %ld\n", ast_node_count);
+    print_counts("  in the final tree:\n", node_type_names, nodes, NODE_TYPE_COUNT, 0);
+    print_counts("Evaluations (tree-walker):\n", node_type_names, stat_evals, NODE_TYPE_COUNT, 0);
+    fprintf(stderr, "Symbol lookups:           %ld (%ld comparisons)\n", stat_symbol_lookups, stat_symbol_compares);
+    fprintf(stderr, "Variable lookups:         %ld (%ld comparisons)\n", stat_scope_lookups, stat_scope_compares);
+    fprintf(stderr, "Function lookups:         %ld (%ld comparisons)\n", stat_func_lookups, stat_func_compares);
+    fprintf(stderr, "Heap objects:\n");
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        if (stat_objects[i]) fprintf(stderr, "    %-22s %ld (%ld bytes)\n", object_type_names[i], stat_objects[i], stat_object_bytes[i]);
+    }
+    fprintf(stderr, "Peak stack slots:         %ld\n", stat_peak_stack);
+    fprintf(stderr, "Max call depth:           %ld\n", stat_peak_depth);
+    fprintf(stderr, "Largest array:            %ld elements\n", stat_largest_array);
+}
+
+// ============= BENCHMARK HARNESS =============
+// foldr --bench runs each workload in a fresh process, --runs times, with
+// its output discarded. The wall time and peak RSS of a run come from the
+// parent; the run itself reports its token and AST node counts, parse
+// time and allocation count through the pipe named by FOLDR_BENCH_FD.
+// A binary that does not know that protocol is still timed. With
+// --against=BINARY the runs alternate between BINARY and this one.
+
+#define DEFAULT_BENCH_RUNS 10
+
+// Counters a benchmarked run reports at exit
+int bench_report_fd = -1;
+double bench_parse_seconds = 0;
+
+int bench = 0;
+int bench_runs = DEFAULT_BENCH_RUNS;
+int bench_json = 0;
+const char *bench_against = NULL;
+
+typedef struct {
+    const char *binary;
+    double *times;           // wall ms per run
+    double *parse_times;     // s per run, reported runs only
+    int runs;
+    int reported;
+    int failed;
+    long tokens;
+    long nodes;
+    long allocations;
+    long peak_rss_kb;
+} BenchResult;
+
+void bench_report() {
+    char line[128];
+    int length = snprintf(line, sizeof(line), "%ld %ld %.9f %zu\n", stat_tokens, ast_node_count,
+                          bench_parse_seconds, gc_allocations);
+#ifndef _WIN32
+    if (write(bench_report_fd, line, length) < 0) return;
+#endif
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
 }
 
-Function* find_func(Environment *env, const char *name) {
-    for (int i = 0; i < env->func_count; i++) {
-        if (strcmp(env->funcs[i].name, name) == 0) {
-            return &env->funcs[i];
+// Nearest-rank percentile of n values, sorted in place.
+double percentile(double *values, int n, double p) {
+    if (n == 0) return 0;
+    qsort(values, n, sizeof(double), compare_doubles);
+    int rank = (int)ceil(p / 100 * n);
+    return values[rank > 0 ? rank - 1 : 0];
+}
+
+#ifndef _WIN32
+void bench_run(BenchResult *r, char **args) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        fprintf(stderr, "Error: Cannot create pipe for benchmark\n");
+        exit(1);
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, 0);
+        dup2(null, 1);
+        char fd_text[16];
+        snprintf(fd_text, sizeof(fd_text), "%d", fds[1]);
+        setenv("FOLDR_BENCH_FD", fd_text, 1);
+        execvp(r->binary, args);
+        fprintf(stderr, "Error: Cannot run '%s'\n", r->binary);
+        _exit(127);
+    }
+    close(fds[1]);
+    int status = 0;
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    if (pid < 0 || wait4(pid, &status, 0, &usage) < 0) status = -1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    char line[128];
+    ssize_t length = read(fds[0], line, sizeof(line) - 1);
+    close(fds[0]);
+    if (status != 0) r->failed++;
+    r->times[r->runs++] = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    if (usage.ru_maxrss > r->peak_rss_kb) r->peak_rss_kb = usage.ru_maxrss;
+    if (length > 0) {
+        line[length] = '\0';
+        double parse;
+        if (sscanf(line, "%ld %ld %lf %ld", &r->tokens, &r->nodes, &parse, &r->allocations) == 4) {
+            r->parse_times[r->reported++] = parse;
         }
     }
-    return NULL;
 }
+#endif
 
-void set_var(Environment *env, const char *name, Value val) {
-    Variable *var = find_var(env, name);
-    if (var) {
-        if (var->is_const) {
-            fprintf(stderr, "Error: Cannot reassign const variable '%s'\n", name);
-            exit(1);
+void print_bench_result(const char *workload, BenchResult *r, BenchResult *baseline) {
+    double median = percentile(r->times, r->runs, 50);
+    double p95 = percentile(r->times, r->runs, 95);
+    double parse = percentile(r->parse_times, r->reported, 50);
+    double tokens_per_sec = r->reported && parse > 0 ? r->tokens / parse : 0;
+    double nodes_per_sec = r->reported && parse > 0 ? r->nodes / parse : 0;
+    // A failed run is no measurement, so neither side is compared then
+    int comparable = baseline && !r->failed && !baseline->failed;
+    double change = comparable ? (median / percentile(baseline->times, baseline->runs, 50) - 1) * 100 : 0;
+
+    if (bench_json) {
+        printf("{\"workload\": \"%s\", \"binary\": \"%s\", \"runs\": %d, \"failed\": %d, "
+               "\"median_ms\": %.3f, \"p95_ms\": %.3f, ",
+               workload, r->binary, r->runs, r->failed, median, p95);
+        if (r->reported) {
+            printf("\"tokens\": %ld, \"ast_nodes\": %ld, \"tokens_per_sec\": %.0f, \"nodes_per_sec\": %.0f, "
+                   "\"allocations\": %ld, ", r->tokens, r->nodes, tokens_per_sec, nodes_per_sec, r->allocations);
+        } else {
+            printf("\"tokens\": null, \"ast_nodes\": null, \"tokens_per_sec\": null, \"nodes_per_sec\": null, "
+                   "\"allocations\": null, ");
         }
-        var->value = val;
-    } else {
-        strcpy(env->vars[env->var_count].name, name);
-        env->vars[env->var_count].value = val;
-        env->vars[env->var_count].is_const = 0; // default
-        env->var_count++;
+        printf("\"peak_rss_kb\": %ld", r->peak_rss_kb);
+        if (comparable) printf(", \"change_pct\": %.2f", change);
+        else if (baseline) printf(", \"change_pct\": null");
+        printf("}\n");
+        fflush(stdout);
+        return;
     }
+
+    printf("%-22s %-18s %4d %10.2f %10.2f", workload, r->binary, r->runs, median, p95);
+    if (r->reported) printf(" %12.0f %12.0f %10ld", tokens_per_sec, nodes_per_sec, r->allocations);
+    else printf(" %12s %12s %10s", "-", "-", "-");
+    printf(" %10ld", r->peak_rss_kb);
+    if (comparable) printf(" %+7.1f%%", change);
+    else if (baseline) printf(" %8s", "-");
+    if (r->failed) printf("  (%d failed)", r->failed);
+    printf("\n");
+    fflush(stdout);
 }
 
+// Options other than the harness's own are passed on to every run.
+int run_benchmarks(int argc, char *argv[]) {
+#ifdef _WIN32
+    fprintf(stderr, "Error: --bench is not supported on this platform\n");
+    return 1;
+#else
+    char **args = malloc(sizeof(char*) * (argc + 2));
+    int option_count = 1;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (arg[0] != '-' || strcmp(arg, "--bench") == 0 || strcmp(arg, "--json") == 0 ||
+            strncmp(arg, "--runs=", 7) == 0 || strncmp(arg, "--against=", 10) == 0) {
+            continue;
+        }
+        args[option_count++] = argv[i];
+    }
 
-Value eval(ASTNode *node, Environment *env);
+    if (!bench_json) {
+        printf("%-22s %-18s %4s %10s %10s %12s %12s %10s %10s%s\n", "workload", "binary", "runs", "median ms",
+               "p95 ms", "tokens/s", "nodes/s", "allocs", "peak KB", bench_against ? "   change" : "");
+        fflush(stdout);
+    }
+    int failed = 0;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-') continue;
+        args[option_count] = argv[i];
+        args[option_count + 1] = NULL;
 
-Value eval_binary(ASTNode *node, Environment *env) {
-    Value left = eval(node->data.binary.left, env);
-    Value right = eval(node->data.binary.right, env);
-    const char *op = node->data.binary.op;
-    
-    if (strcmp(op, "+") == 0) {
-        if (left.type == VAL_INT && right.type == VAL_INT) {
-            return create_int(left.data.int_val + right.data.int_val);
+        BenchResult results[2];
+        int count = bench_against ? 2 : 1;
+        for (int b = 0; b < count; b++) {
+            BenchResult *r = &results[b];
+            memset(r, 0, sizeof(BenchResult));
+            r->binary = b == 0 && bench_against ? bench_against : argv[0];
+            r->times = malloc(sizeof(double) * bench_runs);
+            r->parse_times = malloc(sizeof(double) * bench_runs);
         }
-        if (left.type == VAL_STRING || right.type == VAL_STRING) {
-            char result[1000];
-            if (left.type == VAL_STRING && right.type == VAL_STRING) {
-                sprintf(result, "%s%s", left.data.string_val, right.data.string_val);
-            } else if (left.type == VAL_STRING && right.type == VAL_INT) {
-                sprintf(result, "%s%d", left.data.string_val, right.data.int_val);
-            } else if (left.type == VAL_INT && right.type == VAL_STRING) {
-                sprintf(result, "%d%s", left.data.int_val, right.data.string_val);
+        // Interleaved so that drift in machine load hits both binaries
+        for (int run = 0; run < bench_runs; run++) {
+            for (int b = 0; b < count; b++) {
+                args[0] = (char*)results[b].binary;
+                bench_run(&results[b], args);
             }
-            return create_string(result);
         }
-        return create_float(left.data.float_val + right.data.float_val);
-    }
-    if (strcmp(op, "-") == 0) {
-        return create_int(left.data.int_val - right.data.int_val);
+        for (int b = 0; b < count; b++) {
+            print_bench_result(argv[i], &results[b], b == 1 ? &results[0] : NULL);
+            failed |= results[b].failed > 0;
+        }
+        for (int b = 0; b < count; b++) {
+            free(results[b].times);
+            free(results[b].parse_times);
+        }
     }
-    if (strcmp(op, "*") == 0) {
-        return create_int(left.data.int_val * right.data.int_val);
+    free(args);
+    return failed;
+#endif
+}
+
+// ============= RUNNING A PROGRAM =============
+// Options that belong to one run. main() fills them in from its command
+// line, and a --serve child from the command line its client forwarded.
+typedef struct {
+    const char *filename;
+    int use_vm;
+    int gc_stats;
+    int line_buffered;
+    int profile;
+    int use_cache;
+    const char *serve_path;
+    const char *client_path;
+} RunOptions;
+
+// Returns -1 to go on, or the exit status for options that end the run
+// (--help, --version and errors).
+int parse_options(int argc, char *argv[], RunOptions *opts) {
+    memset(opts, 0, sizeof(RunOptions));
+    opts->use_cache = 1;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+            printf("Foldr Programming Language v%s\n\n", VERSION);
+            printf("Usage:\n");
+            printf("  foldr                      Show ASCII logo and version\n");
+            printf("  foldr [options] <file.fld> Run a Foldr program (- reads it from stdin)\n");
+            printf("  foldr --help               Show this help message\n");
+            printf("  foldr --version            Show version information\n");
+            printf("\nOptions:\n");
+            printf("  --engine=tree|vm           Tree-walking interpreter (default) or bytecode VM\n");
+            printf("  --max-heap=SIZE            Limit the heap to SIZE bytes (K, M, G suffixes)\n");
+            printf("  --gc-stats                 Print garbage collector statistics at exit\n");
+            printf("  --max-depth=N              Allow N nested function calls (default 1000000, 0 = no limit)\n");
+            printf("  --auto-memo                Cache the results of every pure function\n");
+            printf("  -O0, -O1                   Optimization level (default 0)\n");
+            printf("  --dump-ast                 Print the resolved (and optimized) syntax tree and exit\n");
+            printf("  --output-buffer=SIZE       Buffer SIZE bytes of output before writing (default 64K)\n");
+            printf("  --line-buffered            Write output after every line (default on a terminal)\n");
+            printf("  --profile[=FILE]           Report where time is spent; write folded stacks to FILE\n");
+            printf("  --stats[=json]             Print interpreter counters at exit\n");
+            printf("  --cache-dir=DIR            Keep compiled programs in DIR (default ~/.cache/foldr)\n");
+            printf("  --no-cache                 Always parse the program; neither read nor write the cache\n");
+            printf("\nServer:\n");
+            printf("  foldr --serve SOCKET       Serve requests on the Unix socket SOCKET\n");
+            printf("  foldr --client SOCKET [options] <file.fld>\n");
+            printf("                             Run a program on the server at SOCKET\n");
+            printf("\nBenchmarking:\n");
+            printf("  foldr --bench [options] <file.fld>...\n");
+            printf("  --runs=N                   Runs per workload (default %d)\n", DEFAULT_BENCH_RUNS);
+            printf("  --against=BINARY           Also run BINARY and compare the median times\n");
+            printf("  --json                     One JSON object per result instead of a table\n");
+            return 0;
+        }
+
+        if (strcmp(arg, "--version") == 0 || strcmp(arg, "-v") == 0) {
+            printf("Foldr v%s\n", VERSION);
+            return 0;
+        }
+
+        if (strncmp(arg, "--engine=", 9) == 0) {
+            if (strcmp(arg + 9, "vm") == 0) opts->use_vm = 1;
+            else if (strcmp(arg + 9, "tree") == 0) opts->use_vm = 0;
+            else {
+                fprintf(stderr, "Error: Unknown engine '%s'\n", arg + 9);
+                return 1;
+            }
+        } else if (strncmp(arg, "--max-heap=", 11) == 0) {
+            gc_max_heap = parse_size(arg + 11);
+            if (gc_max_heap == 0) {
+                fprintf(stderr, "Error: Invalid heap size '%s'\n", arg + 11);
+                return 1;
+            }
+            if (gc_next_collection > gc_max_heap) gc_next_collection = gc_max_heap;
+        } else if (strcmp(arg, "--gc-stats") == 0) {
+            opts->gc_stats = 1;
+        } else if (strncmp(arg, "--max-depth=", 12) == 0) {
+            char *end;
+            long depth = strtol(arg + 12, &end, 10);
+            if (end == arg + 12 || *end || depth < 0 || depth > INT_MAX) {
+                fprintf(stderr, "Error: Invalid call depth '%s'\n", arg + 12);
+                return 1;
+            }
+            max_call_depth = (int)depth;
+        } else if (strcmp(arg, "--auto-memo") == 0) {
+            auto_memo = 1;
+        } else if (strcmp(arg, "-O0") == 0 || strcmp(arg, "-O1") == 0) {
+            optimize_level = arg[2] - '0';
+        } else if (strcmp(arg, "--dump-ast") == 0) {
+            dump_ast = 1;
+        } else if (strncmp(arg, "--output-buffer=", 16) == 0) {
+            output_capacity = parse_size(arg + 16);
+            if (output_capacity == 0) {
+                fprintf(stderr, "Error: Invalid output buffer size '%s'\n", arg + 16);
+                return 1;
+            }
+        } else if (strcmp(arg, "--line-buffered") == 0) {
+            opts->line_buffered = 1;
+        } else if (strcmp(arg, "--stats") == 0 || strcmp(arg, "--stats=text") == 0) {
+            stats_format = 1;
+        } else if (strcmp(arg, "--stats=json") == 0) {
+            stats_format = 2;
+        } else if (strcmp(arg, "--bench") == 0) {
+            bench = 1;
+        } else if (strncmp(arg, "--runs=", 7) == 0) {
+            char *end;
+            long runs = strtol(arg + 7, &end, 10);
+            if (end == arg + 7 || *end || runs < 1 || runs > 1000000) {
+                fprintf(stderr, "Error: Invalid run count '%s'\n", arg + 7);
+                return 1;
+            }
+            bench_runs = (int)runs;
+        } else if (strncmp(arg, "--against=", 10) == 0) {
+            bench_against = arg + 10;
+        } else if (strcmp(arg, "--json") == 0) {
+            bench_json = 1;
+        } else if (strcmp(arg, "--no-cache") == 0) {
+            opts->use_cache = 0;
+        } else if (strncmp(arg, "--cache-dir=", 12) == 0) {
+            cache_dir = arg + 12;
+            if (!*cache_dir) {
+                fprintf(stderr, "Error: Empty cache directory\n");
+                return 1;
+            }
+        } else if (strcmp(arg, "--profile") == 0) {
+            opts->profile = 1;
+        } else if (strncmp(arg, "--profile=", 10) == 0) {
+            opts->profile = 1;
+            profile_path = arg + 10;
+        } else if (strcmp(arg, "--serve") == 0 || strcmp(arg, "--client") == 0) {
+            if (i + 1 == argc) {
+                fprintf(stderr, "Error: %s needs a socket path\n", arg);
+                return 1;
+            }
+            if (arg[2] == 's') opts->serve_path = argv[++i];
+            else opts->client_path = argv[++i];
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            fprintf(stderr, "Error: Unknown option '%s'\n", arg);
+            return 1;
+        } else {
+            opts->filename = arg;
+        }
     }
-    if (strcmp(op, "/") == 0) {
-        return create_int(left.data.int_val / right.data.int_val);
+    return -1;
+}
+
+// Prints --stats and the --bench report when the program exits.
+void report_at_exit(ASTNode *program, double parse_seconds) {
+    if (stats_format) {
+        stats_program = program;
+        atexit(print_stats);
     }
-    if (strcmp(op, "%") == 0) {
-        return create_int(left.data.int_val % right.data.int_val);
+    if (bench_report_fd >= 0) {
+        bench_parse_seconds = parse_seconds;
+        atexit(bench_report);
     }
-    if (strcmp(op, ">") == 0) {
-        return create_bool(left.data.int_val > right.data.int_val);
+}
+
+// Loads the compiled program for this source from the cache, or parses,
+// resolves and optimizes it and saves it there.
+ASTNode* compile_source(const char *source, size_t source_size, RunOptions *opts) {
+    // A benchmarked run parses unless a cache was asked for, so its
+    // front-end figures measure the parser
+    if (!cache_dir && bench_report_fd < 0) cache_dir = default_cache_dir();
+    if (!opts->use_cache) cache_dir = NULL;
+    unsigned long long source_hash = 0;
+    char *cached = NULL;
+
+    // Load the compiled program, or parse it
+    struct timespec parse_start, parse_end;
+    clock_gettime(CLOCK_MONOTONIC, &parse_start);
+    ASTNode *program = NULL;
+    if (cache_dir) {
+        source_hash = hash_bytes(HASH_SEED, source, source_size);
+        cached = cache_path(source_hash);
+        program = load_cached_program(cached, source_hash, source_size);
     }
-    if (strcmp(op, "<") == 0) {
-        return create_bool(left.data.int_val < right.data.int_val);
+    int loaded = program != NULL;
+    if (!loaded) {
+        // Tokens are scanned on demand as the parser asks for them
+        Tokenizer tok;
+        init_tokenizer(&tok, source, source_size);
+        program = parse_program(&tok);
+        stat_tokens = tok.count;
     }
-    if (strcmp(op, ">=") == 0) {
-        return create_bool(left.data.int_val >= right.data.int_val);
+    clock_gettime(CLOCK_MONOTONIC, &parse_end);
+    report_at_exit(program, (parse_end.tv_sec - parse_start.tv_sec) + (parse_end.tv_nsec - parse_start.tv_nsec) / 1e9);
+
+    // Resolve names to slots; a cached program already is
+    if (!loaded) {
+        resolve_program(program);
+        if (optimize_level) optimize_program(program);
+        if (cached) save_cached_program(cached, program, source_hash, source_size);
     }
-    if (strcmp(op, "<=") == 0) {
-        return create_bool(left.data.int_val <= right.data.int_val);
+    free(cached);
+    return program;
+}
+
+// Runs a compiled program and returns its exit status.
+int run_program(ASTNode *program, RunOptions *opts) {
+    analyze_purity();
+
+    if (dump_ast) {
+        dump_node(program, 0);
+        return 0;
     }
-    if (strcmp(op, "==") == 0) {
-        return create_bool(left.data.int_val == right.data.int_val);
+
+    if (opts->profile) start_profiler(opts->filename);
+
+    if (opts->use_vm) {
+        // Compile to bytecode and run
+        vm_run(compile_program(program));
+    } else {
+        // Interpret
+        funcs = calloc(func_count + 1, sizeof(Function));
+        eval_program(program);
     }
-    if (strcmp(op, "!=") == 0) {
-        return create_bool(left.data.int_val != right.data.int_val);
+
+    if (opts->gc_stats) {
+        flush_output();
+        gc_print_stats();
     }
-    
-    return create_null();
+    return 0;
 }
 
-Value eval(ASTNode *node, Environment *env) {
-    if (!node) return create_null();
-    
-    switch (node->type) {
+// ============= SERVER =============
+// foldr --serve SOCKET is a long-lived interpreter listening on a Unix
+// socket, and foldr --client SOCKET [options] file.fld runs a program on
+// it. The client sends its command line and working directory, and its
+// stdin, stdout and stderr as file descriptors, so the program reads and
+// writes them directly; the server answers with the exit status. Each
+// connection is handed to a forked child as soon as it is accepted, so a
+// slow or silent client holds up only its own request. The child starts
+// from the server's warm state and leaves nothing behind for the next
+// request. The server keeps every program it has seen compiled, keyed
+// like the .fldc cache. A child that has to compile its program first
+// sends it back as a .fldc image, which the server collects in its poll
+// loop, so a parse error only ends that request.
 
-        case NODE_BREAK_STMT:
-            break_flag = 1;
-            return create_null();
+#ifndef _WIN32
+#define SERVE_MAGIC 0x52444c46           // "FLDR"
+#define SERVE_MAX_PROGRAMS 1024
+#define SERVE_MAX_REQUEST (256 * 1024 * 1024)
+#define SERVE_REQUEST_TIMEOUT 10         // seconds a client may take to send its request
 
-        case NODE_CONTINUE_STMT:
-            continue_flag = 1;
-            return create_null();
+// Followed by `length` bytes: the working directory, the file name and
+// `argc` options as NUL-terminated strings, then the source if the file
+// name is "-".
+typedef struct {
+    int magic;
+    int argc;
+    int length;
+} ServeRequest;
 
-        case NODE_WHILE_STMT: {
-            while (1) {
-                Value cond = eval(node->data.while_stmt.condition, env);
-                int is_true = (cond.type == VAL_BOOL && cond.data.bool_val) ||
-                            (cond.type == VAL_INT && cond.data.int_val != 0);
+// A program compiled for the server, with the resolver's tables that go
+// with it.
+typedef struct {
+    unsigned long long source_hash;
+    size_t source_size;
+    int optimize_level;
+    ASTNode *program;
+    int func_count;
+    Symbol **func_names;
+    ASTNode **func_decls;
+    int func_decl_count;
+    int global_slots;
+} ServedProgram;
 
-                if (!is_true) break;
+typedef struct {
+    pid_t pid;
+    int client;              // socket the exit status goes back on
+    int report;              // pipe the child's compiled program comes back on, or -1
+    char *image;             // what has arrived on it so far
+    size_t image_size;
+    size_t image_capacity;
+} ServeChild;
 
-                eval(node->data.while_stmt.body, env);
+ServedProgram *served = NULL;
+int served_count = 0;
+ServeChild *serve_children = NULL;
+int serve_child_count = 0;
+int serve_child_capacity = 0;
+int serve_wakeup[2] = { -1, -1 };  // written by the signal handler
+volatile sig_atomic_t serve_stopping = 0;
 
-                if (return_flag) break;
+int read_full(int fd, void *data, size_t length) {
+    char *p = data;
+    while (length > 0) {
+        ssize_t n = read(fd, p, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        length -= n;
+    }
+    return 1;
+}
 
-                if (break_flag) {
-                    break_flag = 0;
-                    break;
-                }
+int write_full(int fd, const void *data, size_t length) {
+    const char *p = data;
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        length -= n;
+    }
+    return 1;
+}
 
-                if (continue_flag) {
-                    continue_flag = 0;
-                    continue;
-                }
-            }
-            return create_null();
+// Reads the rest of fd into memory; NULL if it cannot be read.
+char* read_fd(int fd, size_t *size) {
+    size_t capacity = 4096;
+    char *data = malloc(capacity);
+    *size = 0;
+    for (;;) {
+        if (*size == capacity) data = realloc(data, capacity *= 2);
+        ssize_t n = read(fd, data + *size, capacity - *size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            free(data);
+            return NULL;
         }
+        if (n == 0) return data;
+        *size += n;
+    }
+}
 
-        case NODE_PROGRAM:
-        case NODE_BLOCK:
-            for (int i = 0; i < node->data.block.stmt_count; i++) {
-                eval(node->data.block.statements[i], env);
-                if (return_flag || break_flag || continue_flag) break;
-            }
-            return create_null();
+void serve_signal(int sig) {
+    int saved = errno;
+    if (sig != SIGCHLD) serve_stopping = 1;
+    if (write(serve_wakeup[1], "", 1) < 0) {}
+    errno = saved;
+}
 
-            
-        case NODE_FUNC_DECL: {
-            Function *func = &env->funcs[env->func_count++];
-            strcpy(func->name, node->data.func.name);
-            func->params = node->data.func.params;
-            func->param_count = node->data.func.param_count;
-            func->body = node->data.func.body;
-            return create_null();
-        }
-        
-        case NODE_VAR_DECL: {
-            Value val = eval(node->data.var.init, env);
-            set_var(env, node->data.var.name, val);
+ServedProgram* find_served(unsigned long long source_hash, size_t source_size, int level) {
+    for (int i = 0; i < served_count; i++) {
+        ServedProgram *p = &served[i];
+        if (p->source_hash == source_hash && p->source_size == source_size && p->optimize_level == level) return p;
+    }
+    return NULL;
+}
 
-            Variable *v = find_var(env, node->data.var.name);
-            if (v) v->is_const = node->data.var.is_const;
+// Moves a freshly decoded program and the resolver's tables into the
+// server's list, leaving the tables empty for the next one.
+void keep_served(ASTNode *program, unsigned long long source_hash, size_t source_size, int level) {
+    if (!served) served = malloc(sizeof(ServedProgram) * SERVE_MAX_PROGRAMS);
+    ServedProgram *p = &served[served_count++];
+    p->source_hash = source_hash;
+    p->source_size = source_size;
+    p->optimize_level = level;
+    p->program = program;
+    p->func_count = func_count;
+    p->func_names = func_names;
+    p->func_decls = func_decls;
+    p->func_decl_count = func_decl_count;
+    p->global_slots = global_scope.slot_count;
+    func_count = func_name_capacity = 0;
+    func_names = NULL;
+    func_decls = NULL;
+    func_decl_count = func_decl_capacity = 0;
+    global_scope.slot_count = 0;
+}
 
-            return create_null();
-        }
-        
-        case NODE_ASSIGN: {
-            Value val = eval(node->data.binary.right, env);
-            const char *op = node->data.binary.op;
-            const char *name = node->data.binary.left->data.identifier.name;
-            
-            if (strcmp(op, "+=") == 0) {
-                Variable *var = find_var(env, name);
-                if (var) {
-                    val.data.int_val += var->value.data.int_val;
-                }
-            } else if (strcmp(op, "-=") == 0) {
-                Variable *var = find_var(env, name);
-                if (var) {
-                    val.data.int_val = var->value.data.int_val - val.data.int_val;
-                }
-            }
-            
-            set_var(env, name, val);
-            return create_null();
-        }
-        
-        case NODE_IF_STMT: {
-            Value cond = eval(node->data.if_stmt.condition, env);
-            int is_true = (cond.type == VAL_BOOL && cond.data.bool_val) || 
-                         (cond.type == VAL_INT && cond.data.int_val != 0);
-            
-            if (is_true) {
-                eval(node->data.if_stmt.then_branch, env);
-            } else if (node->data.if_stmt.else_branch) {
-                eval(node->data.if_stmt.else_branch, env);
+void install_served(ServedProgram *p) {
+    func_count = func_name_capacity = p->func_count;
+    func_names = p->func_names;
+    func_decls = p->func_decls;
+    func_decl_count = func_decl_capacity = p->func_decl_count;
+    global_scope.slot_count = p->global_slots;
+}
+
+// The last -O option on a forwarded command line, as the child will see it.
+int request_optimize_level(int argc, char **argv) {
+    int level = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-O0") == 0 || strcmp(argv[i], "-O1") == 0) level = argv[i][2] - '0';
+    }
+    return level;
+}
+
+// Runs one request in the forked child; does not return. With a
+// `report` pipe the child compiles the program itself and writes its
+// .fldc image there before running it.
+void run_request(int fds[3], const char *cwd, int argc, char **argv, const char *source, size_t source_size,
+                 ServedProgram *program, int report) {
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        if (fds[i] > 2) close(fds[i]);
+    }
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    if (chdir(cwd) != 0) {}
+    reset_counters();
+
+    RunOptions opts;
+    int status = parse_options(argc, argv, &opts);
+    if (status >= 0) {
+        fflush(stdout);
+        exit(status);
+    }
+    init_output();
+    if (opts.line_buffered) output_line_buffered = 1;
+
+    ASTNode *root;
+    if (program) {
+        install_served(program);
+        root = program->program;
+        report_at_exit(root, 0);
+    } else {
+        root = compile_source(source, source_size, &opts);
+        if (report >= 0) {
+            CacheHeader h;
+            WordBuffer payload;
+            if (encode_program(root, hash_bytes(HASH_SEED, source, source_size), source_size, &h, &payload) &&
+                write_full(report, &h, sizeof(h))) {
+                write_full(report, payload.words, sizeof(int) * payload.count);
             }
-            return create_null();
+            free(payload.words);
+            close(report);
         }
-        
-        case NODE_FOR_STMT: {
-            Value iterable = eval(node->data.for_stmt.iterable, env);
-            if (iterable.type == VAL_ARRAY) {
-                for (int i = 0; i < iterable.data.array_val.count; i++) {
-                    set_var(env, node->data.for_stmt.iterator, *iterable.data.array_val.elements[i]);
+    }
+    exit(run_program(root, &opts));
+}
 
-                    eval(node->data.for_stmt.body, env);
+// Fails a request in its child, before the program starts.
+void reject_request(int err, const char *fmt, const char *arg) {
+    if (err >= 0) {
+        dprintf(err, "Error: ");
+        dprintf(err, fmt, arg);
+        dprintf(err, "\n");
+    }
+    exit(1);
+}
 
-                    if (return_flag) break;
+// Reads one request in the forked child and runs it; does not return.
+// The server sends the exit status once the child is reaped.
+void handle_request(int client, int report) {
+    struct timeval timeout = { SERVE_REQUEST_TIMEOUT, 0 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ServeRequest req;
+    int fds[3] = { -1, -1, -1 };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { &req, sizeof(req) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(client, &msg, 0);
+    struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+    if (fds[0] < 0 || n <= 0 || !read_full(client, (char*)&req + n, sizeof(req) - n) ||
+        req.magic != SERVE_MAGIC || req.argc < 0 || req.length < 0 || req.length > SERVE_MAX_REQUEST ||
+        req.argc > req.length) {
+        reject_request(fds[2], "%s", "Malformed request");
+    }
 
-                    if (break_flag) {
-                        break_flag = 0;
-                        break;
-                    }
+    // Working directory, file name, options, then any source
+    char *body = malloc(req.length + 1);
+    body[req.length] = '\0';
+    char **argv = malloc(sizeof(char*) * (req.argc + 2));
+    char *p = body, *end = body + req.length;
+    const char *cwd = NULL, *filename = NULL;
+    int ok = read_full(client, body, req.length);
+    close(client);
+    for (int i = -2; ok && i < req.argc; i++) {
+        char *next = memchr(p, '\0', end - p);
+        if (!next) ok = 0;
+        else if (i == -2) cwd = p;
+        else if (i == -1) filename = p;
+        else argv[i + 1] = p;
+        p = next ? next + 1 : end;
+    }
+    if (!ok) reject_request(fds[2], "%s", "Malformed request");
+    char *source = NULL;
+    size_t source_size = end - p;
+    if (strcmp(filename, "-") == 0) {
+        source = p;
+    } else {
+        size_t length = strlen(cwd) + strlen(filename) + 2;
+        char *path = malloc(length);
+        snprintf(path, length, "%s%s%s", filename[0] == '/' ? "" : cwd, filename[0] == '/' ? "" : "/", filename);
+        int fd = open(path, O_RDONLY);
+        free(path);
+        if (fd >= 0) {
+            source = read_fd(fd, &source_size);
+            close(fd);
+        }
+        if (!source) reject_request(fds[2], "Cannot open file '%s'", filename);
+    }
+    argv[0] = "foldr";
+    argv[req.argc + 1] = NULL;
 
-                    if (continue_flag) {
-                        continue_flag = 0;
-                        continue;
-                    }
-                }
-            }
-            return create_null();
+    // Programs the server has not seen are compiled here and sent back
+    unsigned long long source_hash = hash_bytes(HASH_SEED, source, source_size);
+    int level = request_optimize_level(req.argc + 1, argv);
+    ServedProgram *program = find_served(source_hash, source_size, level);
+    if (program && report >= 0) {
+        close(report);
+        report = -1;
+    }
+    run_request(fds, cwd, req.argc + 1, argv, source, source_size, program, report);
+}
+
+// Forks a child for a new connection. The server only remembers it; the
+// child reads the request itself.
+void start_request(int client, int listener) {
+    int report[2] = { -1, -1 };
+    if (served_count < SERVE_MAX_PROGRAMS && pipe(report) < 0) report[0] = report[1] = -1;
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(listener);
+        close(serve_wakeup[0]);
+        close(serve_wakeup[1]);
+        for (int i = 0; i < serve_child_count; i++) {
+            close(serve_children[i].client);
+            if (serve_children[i].report >= 0) close(serve_children[i].report);
         }
+        if (report[0] >= 0) close(report[0]);
+        handle_request(client, report[1]);
+    }
+    if (report[1] >= 0) close(report[1]);
+    if (pid < 0) {
+        int status = 1;
+        write_full(client, &status, sizeof(status));
+        close(client);
+        if (report[0] >= 0) close(report[0]);
+        return;
+    }
+    if (report[0] >= 0) fcntl(report[0], F_SETFL, O_NONBLOCK);
+    if (serve_child_count == serve_child_capacity) {
+        serve_child_capacity = serve_child_capacity ? serve_child_capacity * 2 : 16;
+        serve_children = realloc(serve_children, sizeof(ServeChild) * serve_child_capacity);
+    }
+    ServeChild *c = &serve_children[serve_child_count++];
+    memset(c, 0, sizeof(ServeChild));
+    c->pid = pid;
+    c->client = client;
+    c->report = report[0];
+}
 
-        
-        case NODE_RETURN_STMT:
-            return_value = eval(node->data.return_stmt.value, env);
-            return_flag = 1;
-            return return_value;
-        
-        case NODE_EXPR_STMT:
-            return eval(node->data.block.statements[0], env);
-        
-        case NODE_BINARY_OP:
-            return eval_binary(node, env);
-        
-        case NODE_CALL: {
-            const char *name = node->data.call.name;
-            
+// Keeps the program a child compiled, once its report pipe is closed.
+// The image's header says which source and -O level it is for.
+void finish_report(ServeChild *c) {
+    close(c->report);
+    c->report = -1;
+    CacheHeader h;
+    if (c->image_size >= sizeof(h)) {
+        memcpy(&h, c->image, sizeof(h));
+        int saved_level = optimize_level;
+        optimize_level = h.optimize_level;
+        if (served_count < SERVE_MAX_PROGRAMS && !find_served(h.source_hash, h.source_size, h.optimize_level)) {
+            ASTNode *root = decode_program(c->image, c->image_size, h.source_hash, h.source_size);
+            if (root) keep_served(root, h.source_hash, h.source_size, h.optimize_level);
+        }
+        optimize_level = saved_level;
+    }
+    free(c->image);
+    c->image = NULL;
+    c->image_size = c->image_capacity = 0;
+}
 
-            if (strcmp(name, "input") == 0) {
-                // Optional prompt: input("Enter: ")
-                if (node->data.call.arg_count >= 1) {
-                    Value prompt = eval(node->data.call.args[0], env);
-                    if (prompt.type == VAL_STRING) {
-                        printf("%s", prompt.data.string_val);
-                        fflush(stdout);
-                    }
-                }
+// Takes what a child has written to its report pipe so far. With `wait`
+// set the child has exited and the rest is read to the end.
+void read_report(ServeChild *c, int wait) {
+    if (wait) fcntl(c->report, F_SETFL, 0);
+    for (;;) {
+        if (c->image_size == c->image_capacity) {
+            c->image_capacity = c->image_capacity ? c->image_capacity * 2 : 65536;
+            c->image = realloc(c->image, c->image_capacity);
+        }
+        ssize_t n = read(c->report, c->image + c->image_size, c->image_capacity - c->image_size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return;
+        if (n <= 0) break;
+        c->image_size += n;
+    }
+    finish_report(c);
+}
 
-                char buffer[1024];
-                if (!fgets(buffer, sizeof(buffer), stdin)) {
-                    return create_string("");
-                }
+// Sends each finished child's status to its client: the exit code, or
+// 128 plus the signal that killed it.
+void reap_children() {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < serve_child_count; i++) {
+            ServeChild *c = &serve_children[i];
+            if (c->pid != pid) continue;
+            if (c->report >= 0) read_report(c, 1);
+            int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            write_full(c->client, &code, sizeof(code));
+            close(c->client);
+            *c = serve_children[--serve_child_count];
+            break;
+        }
+    }
+}
 
-                // strip trailing newline
-                size_t len = strlen(buffer);
-                if (len > 0 && buffer[len - 1] == '\n') buffer[len - 1] = '\0';
+int bind_socket(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+#endif
 
-                return create_string(buffer);
-            }
+int serve(const char *path) {
+#ifdef _WIN32
+    fprintf(stderr, "Error: --serve is not supported on this platform\n");
+    return 1;
+#else
+    struct sockaddr_un addr;
+    int listener = bind_socket(path, &addr);
+    if (listener < 0) return 1;
+    // A socket left by a server that is gone is replaced
+    if (connect(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "Error: A server is already listening on '%s'\n", path);
+        return 1;
+    }
+    close(listener);
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 128) < 0) {
+        fprintf(stderr, "Error: Cannot listen on '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
 
+    init_symbols();
+    init_builtins();
+    init_kernels();
+    if (pipe(serve_wakeup) < 0) {
+        fprintf(stderr, "Error: Cannot create pipe for server\n");
+        return 1;
+    }
+    fcntl(serve_wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(serve_wakeup[1], F_SETFL, O_NONBLOCK);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = serve_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
-            // Built-in functions
-            if (strcmp(name, "print") == 0) {
-                for (int i = 0; i < node->data.call.arg_count; i++) {
-                    Value arg = eval(node->data.call.args[i], env);
-                    if (arg.type == VAL_INT) printf("%d", arg.data.int_val);
-                    else if (arg.type == VAL_FLOAT) printf("%f", arg.data.float_val);
-                    else if (arg.type == VAL_STRING) printf("%s", arg.data.string_val);
-                    else if (arg.type == VAL_BOOL) printf("%s", arg.data.bool_val ? "true" : "false");
-                }
-                printf("\n");
-                return create_null();
-            }
-            
-            if (strcmp(name, "str") == 0) {
-                Value arg = eval(node->data.call.args[0], env);
-                char buf[100];
-                if (arg.type == VAL_INT) sprintf(buf, "%d", arg.data.int_val);
-                else if (arg.type == VAL_FLOAT) sprintf(buf, "%f", arg.data.float_val);
-                else if (arg.type == VAL_STRING) return arg;
-                return create_string(buf);
-            }
-            
-            if (strcmp(name, "int") == 0) {
-                Value arg = eval(node->data.call.args[0], env);
-                if (arg.type == VAL_STRING) return create_int(atoi(arg.data.string_val));
-                if (arg.type == VAL_FLOAT) return create_int((int)arg.data.float_val);
-                return arg;
-            }
-            
-            if (strcmp(name, "len") == 0) {
-                Value arg = eval(node->data.call.args[0], env);
-                if (arg.type == VAL_ARRAY) return create_int(arg.data.array_val.count);
-                return create_int(0);
-            }
-            
-            // User-defined functions
-            Function *func = find_func(env, name);
-            if (func) {
-                Environment local_env = *env;
-                for (int i = 0; i < func->param_count && i < node->data.call.arg_count; i++) {
-                    Value arg = eval(node->data.call.args[i], env);
-                    set_var(&local_env, func->params[i], arg);
-                }
-                
-                return_flag = 0;
-                eval(func->body, &local_env);
-                Value ret = return_value;
-                return_flag = 0;
-                return ret;
-            }
-            
-            return create_null();
+    // The listener, the wakeup pipe, then the report pipe of every child
+    // that is still compiling
+    struct pollfd *polls = NULL;
+    int *poll_children = NULL;
+    int poll_capacity = 0;
+    while (!serve_stopping) {
+        if (poll_capacity < serve_child_count + 2) {
+            poll_capacity = serve_child_count + 2 + 16;
+            polls = realloc(polls, sizeof(struct pollfd) * poll_capacity);
+            poll_children = realloc(poll_children, sizeof(int) * poll_capacity);
         }
-        
-        case NODE_LITERAL: {
-            if (node->data.literal.is_number) {
-                if (strchr(node->data.literal.value, '.')) {
-                    return create_float(atof(node->data.literal.value));
-                }
-                return create_int(atoi(node->data.literal.value));
-            }
-            return create_string(node->data.literal.value);
+        polls[0] = (struct pollfd){ listener, POLLIN, 0 };
+        polls[1] = (struct pollfd){ serve_wakeup[0], POLLIN, 0 };
+        int poll_count = 2;
+        for (int i = 0; i < serve_child_count; i++) {
+            if (serve_children[i].report < 0) continue;
+            poll_children[poll_count] = i;
+            polls[poll_count++] = (struct pollfd){ serve_children[i].report, POLLIN, 0 };
         }
-        
-        case NODE_IDENTIFIER: {
-            Variable *var = find_var(env, node->data.identifier.name);
-            if (var) return var->value;
-            return create_null();
+        if (poll(polls, poll_count, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
         }
-        
-        case NODE_ARRAY_LIT: {
-            Value arr;
-            arr.type = VAL_ARRAY;
-            arr.data.array_val.count = node->data.array.element_count;
-            arr.data.array_val.elements = malloc(sizeof(Value*) * arr.data.array_val.count);
-            for (int i = 0; i < arr.data.array_val.count; i++) {
-                arr.data.array_val.elements[i] = malloc(sizeof(Value));
-                *arr.data.array_val.elements[i] = eval(node->data.array.elements[i], env);
-            }
-            return arr;
+        // Reports first: reaping reorders the children
+        for (int i = 2; i < poll_count; i++) {
+            if (polls[i].revents) read_report(&serve_children[poll_children[i]], 0);
         }
-        
-        case NODE_INDEX: {
-            Variable *var = find_var(env, node->data.index.name);
-            if (var && var->value.type == VAL_ARRAY) {
-                Value idx = eval(node->data.index.index, env);
-                if (idx.type == VAL_INT && idx.data.int_val < var->value.data.array_val.count) {
-                    return *var->value.data.array_val.elements[idx.data.int_val];
-                }
-            }
-            return create_null();
+        if (polls[1].revents) {
+            char drain[64];
+            while (read(serve_wakeup[0], drain, sizeof(drain)) > 0) {}
+            reap_children();
         }
-        
-        default:
-            return create_null();
+        if (polls[0].revents & POLLIN) {
+            int client = accept(listener, NULL, NULL);
+            if (client >= 0) start_request(client, listener);
+        }
+    }
+    free(polls);
+    free(poll_children);
+    close(listener);
+    unlink(path);
+    return 0;
+#endif
+}
+
+// Returns the program's exit status, or -1 if no server is listening,
+// in which case the caller runs the program itself.
+int run_client(const char *path, int argc, char *argv[], RunOptions *opts) {
+#ifdef _WIN32
+    return -1;
+#else
+    struct sockaddr_un addr;
+    int fd = bind_socket(path, &addr);
+    if (fd < 0) return 1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Working directory, file name and options, without --client itself
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) strcpy(cwd, "/");
+    size_t length = strlen(cwd) + strlen(opts->filename) + 2;
+    for (int i = 1; i < argc; i++) length += strlen(argv[i]) + 1;
+    char *body = malloc(length);
+    char *p = body;
+    int count = 0;
+    p += sprintf(p, "%s", cwd) + 1;
+    p += sprintf(p, "%s", opts->filename) + 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--client") == 0) {
+            i++;
+            continue;
+        }
+        p += sprintf(p, "%s", argv[i]) + 1;
+        count++;
+    }
+    length = p - body;
+    size_t source_size = 0;
+    char *source = NULL;
+    if (strcmp(opts->filename, "-") == 0) {
+        source = read_fd(0, &source_size);
+        if (!source) source_size = 0;
+    }
+
+    ServeRequest req = { SERVE_MAGIC, count, (int)(length + source_size) };
+    int fds[3] = { 0, 1, 2 };
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { &req, sizeof(req) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int status;
+    if (sendmsg(fd, &msg, 0) != sizeof(req) || !write_full(fd, body, length) ||
+        !write_full(fd, source, source_size) || !read_full(fd, &status, sizeof(status))) {
+        fprintf(stderr, "Error: Lost the connection to the server at '%s'\n", path);
+        status = 1;
     }
+    close(fd);
+    free(body);
+    free(source);
+    return status;
+#endif
 }
 
 // ============= MAIN =============
@@ -1135,37 +6623,34 @@ int main(int argc, char *argv[]) {
         show_logo();
         return 0;
     }
-    
-    if (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0) {
-        printf("Foldr Programming Language v%s\n\n", VERSION);
-        printf("Usage:\n");
-        printf("  foldr              Show ASCII logo and version\n");
-        printf("  foldr <file.fld>   Run a Foldr program\n");
-        printf("  foldr --help       Show this help message\n");
-        printf("  foldr --version    Show version information\n");
-        return 0;
+
+    RunOptions opts;
+    int status = parse_options(argc, argv, &opts);
+    if (status >= 0) return status;
+    if (opts.serve_path) return serve(opts.serve_path);
+
+    if (!opts.filename) {
+        fprintf(stderr, "Error: No input file\n");
+        return 1;
     }
-    
-    if (strcmp(argv[1], "--version") == 0 || strcmp(argv[1], "-v") == 0) {
-        printf("Foldr v%s\n", VERSION);
-        return 0;
+    if (bench) return run_benchmarks(argc, argv);
+    if (opts.client_path) {
+        status = run_client(opts.client_path, argc, argv, &opts);
+        if (status >= 0) return status;
     }
-    
-    const char *filename = argv[1];
-    char *source = read_file(filename);
-    
-    // Tokenize
-    Tokenizer tok;
-    tokenize(source, &tok);
-    
-    // Parse
-    ASTNode *program = parse_program(&tok);
-    
-    // Interpret
-    global_env.var_count = 0;
-    global_env.func_count = 0;
-    eval(program, &global_env);
-    
-    free(source);
-    return 0;
+    // Set in the runs started by --bench
+    const char *report_fd = getenv("FOLDR_BENCH_FD");
+    if (report_fd) bench_report_fd = atoi(report_fd);
+
+    size_t source_size;
+    const char *source = map_file(opts.filename, &source_size);
+
+    init_symbols();
+    init_builtins();
+    init_kernels();
+    init_output();
+    if (opts.line_buffered) output_line_buffered = 1;
+
+    ASTNode *program = compile_source(source, source_size, &opts);
+    return run_program(program, &opts);
 }